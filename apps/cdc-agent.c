@@ -19,28 +19,36 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <glib-unix.h>
+#include <signal.h>
 #include <playerctl.h>
 #include "ikbuscdc.h"
 
 #define CONFIGDIR "/etc"
 #define CONFIG_NAME "cdc.conf"
 
-#define MAGAZINE_SIZE 6
+#define MAGAZINE_SIZE 6     /* Default, up to IKBUS_CDC_MAX_DISCS */
+#define SETTLE_TIME 100 /* ms */
+#define DEFAULT_IFNAME "ibus0"
+#define DEFAULT_CAPTURE_FILE "/tmp/cdc-agent.pcap"
+#define MPRIS_NAMESPACE "org.mpris.MediaPlayer2"
+#define MPRIS_PATH "/org/mpris/MediaPlayer2"
+#define MPRIS_PLAYER MPRIS_NAMESPACE ".Player"
+#define MPRIS_TIMEOUT 2000  /* ms */
 
 
 static GKeyFile *cdc_conf;
 static GDBusProxy *session;
+static GHashTable *players;         /* MPRIS bus name -> cd_t */
 static GMainLoop *loop;
-
-static const gchar * const supported_options[] = {
-    /* [Magazine] */
-    "cd1",
-    "cd2",
-    "cd3",
-    "cd4",
-    "cd5",
-    "cd6",
-};
+static guint settle_time = SETTLE_TIME;
+static gchar *ifname;
+static gboolean io_thread;
+static guint head_unit = IKBUS_CDC_HEAD_UNIT_GENERIC;
+static guint announce_interval;     /* s, 0 for the head unit default */
+static guint tx_gap;                /* us between frames, 0 to write at once */
+static gchar *capture_file;
+static guint status_update_id;
 
 enum {
   PLAY,
@@ -49,29 +57,43 @@ enum {
   LAST_SIGNAL
 };
 
+typedef enum {
+    TRANSPORT_NONE,
+    TRANSPORT_PLAY,
+    TRANSPORT_PAUSE,
+    TRANSPORT_PLAY_PAUSE,
+} transport_t;
+
+/* Command waiting for the player */
+typedef struct {
+    transport_t transport;          /* TRANSPORT_NONE for a skip */
+    gint skip;                      /* Next (> 0) or previous (< 0) presses */
+} command_t;
+
 typedef struct cd {
     guint number;
     PlayerctlPlayer *mpris;
     gboolean active;
     gchar *mpris_name;
+    const gchar *bus_name;          /* Interned MPRIS bus name */
     gulong signal_id[LAST_SIGNAL];
+    GCancellable *attach;           /* Player being created, NULL otherwise */
+    gboolean busy;                  /* MPRIS call in flight */
+    GQueue pending;                 /* command_t, in arrival order */
 } cd_t;
 
 static struct {
     IKBusCdc *cdc;
-    cd_t magazine[MAGAZINE_SIZE];
+    cd_t *magazine;
+    guint magazine_size;
+    guint64 active_mask;            /* Bit n set if cd n + 1 has a player */
     guint num_of_cds;
     cd_t *current_cd;
 } cd_changer = {
     .cdc = NULL,
-    .magazine = {
-        {1, NULL, FALSE, NULL, {0}},
-        {2, NULL, FALSE, NULL, {0}},
-        {3, NULL, FALSE, NULL, {0}},
-        {4, NULL, FALSE, NULL, {0}},
-        {5, NULL, FALSE, NULL, {0}},
-        {6, NULL, FALSE, NULL, {0}},
-    },
+    .magazine = NULL,
+    .magazine_size = MAGAZINE_SIZE,
+    .active_mask = 0,
     .num_of_cds = 0,
     .current_cd = NULL,
 };
@@ -96,47 +118,109 @@ static GKeyFile *load_config(const char *file)
     return keyfile;
 }
 
-/* Get players from config file */
+/* Get players from config file and index them by MPRIS bus name */
 static void parse_config(GKeyFile *config)
 {
     GError *err = NULL;
-    gchar *str;
+    gchar key[16];
+    gchar *str, *bus_name;
+    cd_t *cd;
     guint i;
 
+    players = g_hash_table_new(g_str_hash, g_str_equal);
+
+    /* [Changer] */
+    if (config && g_key_file_has_key(config, "Changer", "magazine_size", NULL))
+        cd_changer.magazine_size = CLAMP(g_key_file_get_integer(config, "Changer", "magazine_size", NULL),
+                                         1, IKBUS_CDC_MAX_DISCS);
+
+    cd_changer.magazine = g_new0(cd_t, cd_changer.magazine_size);
+    for (i = 0; i < cd_changer.magazine_size; i++)
+        cd_changer.magazine[i].number = i + 1;
+
     if (!config)
         return;
 
-    for (i = 0; i < MAGAZINE_SIZE; i++) {
-        str = g_key_file_get_string(config, "Magazine", supported_options[i], &err);
+    /* [Magazine] */
+    for (i = 0; i < cd_changer.magazine_size; i++) {
+        cd = &cd_changer.magazine[i];
+        g_snprintf(key, sizeof(key), "cd%u", cd->number);
+        str = g_key_file_get_string(config, "Magazine", key, &err);
         if (err) {
             g_info("%s\n", err->message);
             g_clear_error(&err);
         } else {
-            cd_changer.magazine[i].mpris_name = str;
+            cd->mpris_name = str;
+            bus_name = g_strconcat(MPRIS_NAMESPACE ".", str, NULL);
+            cd->bus_name = g_intern_string(bus_name);
+            g_free(bus_name);
+            g_hash_table_insert(players, (gpointer) cd->bus_name, cd);
             cd_changer.num_of_cds++;
         }
 
     }
+
+    if (g_key_file_has_key(config, "Changer", "settle_time", NULL))
+        settle_time = CLAMP(g_key_file_get_integer(config, "Changer", "settle_time", NULL),
+                            0, G_MAXINT);
+    /* I/K-bus interface, or "unix:PATH" for a simulated bus */
+    ifname = g_key_file_get_string(config, "Changer", "interface", NULL);
+    /* Answer status polls from a dedicated real-time I/O thread */
+    io_thread = g_key_file_get_boolean(config, "Changer", "io_thread", NULL);
+
+    /* Head unit "generic", "business" or "navigation" sets the announce interval */
+    str = g_key_file_get_string(config, "Changer", "head_unit", NULL);
+    if (!g_strcmp0(str, "business"))
+        head_unit = IKBUS_CDC_HEAD_UNIT_BUSINESS;
+    else if (!g_strcmp0(str, "navigation"))
+        head_unit = IKBUS_CDC_HEAD_UNIT_NAVIGATION;
+    else if ((str != NULL) && g_strcmp0(str, "generic"))
+        g_warning("Unknown head unit %s\n", str);
+    g_free(str);
+    if (g_key_file_has_key(config, "Changer", "announce_interval", NULL))
+        announce_interval = CLAMP(g_key_file_get_integer(config, "Changer", "announce_interval", NULL),
+                                  0, 3600);
+    /* Hold frames back for the bus, so poll replies overtake announces */
+    if (g_key_file_has_key(config, "Changer", "tx_gap", NULL))
+        tx_gap = CLAMP(g_key_file_get_integer(config, "Changer", "tx_gap", NULL), 0, G_USEC_PER_SEC);
+    /* Bus traffic capture, toggled with SIGUSR1 */
+    capture_file = g_key_file_get_string(config, "Changer", "capture_file", NULL);
 }
 
 /*
  PLAYBACK
  */
 
+static gboolean status_update(gpointer data)
+{
+    status_update_id = 0;
+    ikbus_cdc_sync_output(cd_changer.cdc, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+/* Send CD status once the player has stopped changing for settle_time ms */
+static void schedule_status_update(void)
+{
+    if (status_update_id != 0)
+        g_source_remove(status_update_id);
+    status_update_id = g_timeout_add(settle_time, status_update, NULL);
+}
+
 void mpris_metadata(PlayerctlPlayer *player, GVariant *metadata, gpointer data)
 {
-    GValue str = G_VALUE_INIT;
-    gchar *name;
+    gchar *prop;
     gint tracknum = -1;
     gint cdnum = *((gint *) data);
 
-    if (cdnum != cd_changer.current_cd->number)
+    if ((cd_changer.current_cd == NULL) || (cdnum != cd_changer.current_cd->number))
         return;
 
-    tracknum = g_ascii_strtod (playerctl_player_print_metadata_prop(player, "xesam:trackNumber", NULL), NULL);
+    prop = playerctl_player_print_metadata_prop(player, "xesam:trackNumber", NULL);
+    if (prop != NULL)
+        tracknum = g_ascii_strtod(prop, NULL);
+    g_free(prop);
     ikbus_cdc_set_track(cd_changer.cdc, tracknum);
-    g_usleep (100000);
-    ikbus_cdc_sync_output(cd_changer.cdc, NULL);
+    schedule_status_update();
 }
 
 void mpris_play(PlayerctlPlayer *player, gpointer data)
@@ -149,41 +233,36 @@ void mpris_stop(PlayerctlPlayer *player, gpointer data)
 
 }
 
-static cd_t *find_cd_by_player_name(const gchar *player_name)
+/* playerctl_player_new() waits for the player on D-Bus, keep it off the main loop */
+static void player_new_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
 {
-    guint i;
-    cd_t *ret = NULL;
-
-    if (player_name == NULL)
-        return ret;
-
-    for (i = 0; i < MAGAZINE_SIZE; i++) {
-        if (g_strcmp0(cd_changer.magazine[i].mpris_name, player_name) == 0) {
-            ret = &cd_changer.magazine[i];
-            break;
-        }
-    }
+    PlayerctlPlayer *mpris;
+    GError *error = NULL;
 
-    return ret;
+    mpris = playerctl_player_new(data, &error);
+    if (mpris == NULL)
+        g_task_return_error(task, error);
+    else
+        g_task_return_pointer(task, mpris, g_object_unref);
 }
 
-static void attach_player_to_cd(gchar* player_name, cd_t *cd)
+static void attach_player_done(GObject *source, GAsyncResult *res, gpointer data)
 {
-    PlayerctlPlayer *mpris = NULL;
+    cd_t *cd = data;
+    PlayerctlPlayer *mpris;
     GError *error = NULL;
 
-    if ((player_name == NULL) || (cd == NULL))
-        return;
-
-    if (cd->active == TRUE) {
-        g_warning("attach_player_to_cd: Double attach cd%d\n", cd->number);
+    mpris = g_task_propagate_pointer(G_TASK(res), &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        /* Detached meanwhile */
+        g_error_free(error);
         return;
     }
-
-    mpris = playerctl_player_new(player_name, &error);
+    g_clear_object(&cd->attach);
     if (mpris == NULL) {
         g_warning("add_player: %s\n", error->message);
-         return;
+        g_error_free(error);
+        return;
     }
 
     cd->mpris = mpris;
@@ -191,13 +270,42 @@ static void attach_player_to_cd(gchar* player_name, cd_t *cd)
     g_signal_connect(G_OBJECT (mpris), "stop", G_CALLBACK(mpris_stop), &cd->number);
     g_signal_connect(G_OBJECT (mpris), "metadata", G_CALLBACK(mpris_metadata), &cd->number);
     cd->active = TRUE;
+    cd_changer.active_mask |= G_GUINT64_CONSTANT(1) << (cd->number - 1);
     ikbus_cdc_insert_cd(cd_changer.cdc, cd->number);
     if (cd_changer.current_cd == NULL) {
         cd_changer.current_cd = cd;
         ikbus_cdc_set_cd(cd_changer.cdc, cd_changer.current_cd->number);
         ikbus_cdc_set_error (cd_changer.cdc, 0);
     }
-    g_print("Attach %s to cd%d\n", player_name, cd->number);
+    ikbus_cdc_sync_output(cd_changer.cdc, NULL);
+    g_print("Attach %s to cd%d\n", cd->mpris_name, cd->number);
+}
+
+static void attach_player_to_cd(gchar* player_name, cd_t *cd)
+{
+    GTask *task;
+
+    if ((player_name == NULL) || (cd == NULL) || (cd->attach != NULL))
+        return;
+
+    if (cd->active == TRUE) {
+        g_warning("attach_player_to_cd: Double attach cd%d\n", cd->number);
+        return;
+    }
+
+    cd->attach = g_cancellable_new();
+    task = g_task_new(NULL, cd->attach, attach_player_done, cd);
+    g_task_set_task_data(task, g_strdup(player_name), g_free);
+    g_task_run_in_thread(task, player_new_thread);
+    g_object_unref(task);
+}
+
+static void player_clear_pending(cd_t *cd)
+{
+    command_t *cmd;
+
+    while ((cmd = g_queue_pop_head(&cd->pending)) != NULL)
+        g_free(cmd);
 }
 
 static void deatach_player(cd_t *cd)
@@ -205,18 +313,24 @@ static void deatach_player(cd_t *cd)
     if (cd == NULL)
         return;
 
-    if (cd->active = TRUE) {
-        guint i;
+    if (cd->attach != NULL) {
+        g_cancellable_cancel(cd->attach);
+        g_clear_object(&cd->attach);
+    }
+
+    if (cd->active == TRUE) {
         g_clear_object(&cd->mpris);
         cd->active = FALSE;
+        player_clear_pending(cd);
+        cd_changer.active_mask &= ~(G_GUINT64_CONSTANT(1) << (cd->number - 1));
         ikbus_cdc_remove_cd(cd_changer.cdc, cd->number);
         g_print("Detach cd%d\n", cd->number);
-        if (cd->number != cd_changer.current_cd->number)
+        if (cd != cd_changer.current_cd)
             return;
 
-        for (i = 0; (i < MAGAZINE_SIZE) && (cd_changer.magazine[i].active != TRUE); i++);
-        if (i < MAGAZINE_SIZE) {
-            cd_changer.current_cd = &cd_changer.magazine[i];
+        /* First cd still having a player */
+        if (cd_changer.active_mask != 0) {
+            cd_changer.current_cd = &cd_changer.magazine[__builtin_ctzll(cd_changer.active_mask)];
             ikbus_cdc_set_cd(cd_changer.cdc, cd_changer.current_cd->number);
             
         }
@@ -229,132 +343,265 @@ static void deatach_player(cd_t *cd)
     }
 }
 
+/*
+ MPRIS COMMANDS
+
+ Players are driven with asynchronous MPRIS calls, so a slow player never
+ holds up the bus. Each player has at most one call in flight; presses
+ arriving meanwhile are queued in arrival order. A press following one of
+ the same kind is merged with it into the state both leave the player in:
+ play or pause wins, a play/pause toggle flips a queued play or pause, two
+ toggles cancel out and skips add up.
+ */
+
+static void player_kick(cd_t *cd);
+
+static void player_call_done(GObject *source, GAsyncResult *res, gpointer data)
+{
+    cd_t *cd = data;
+    GError *error = NULL;
+    GVariant *reply;
+
+    reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (reply == NULL) {
+        g_warning("cd%d: %s\n", cd->number, error->message);
+        g_error_free(error);
+    }
+    else {
+        g_variant_unref(reply);
+    }
+
+    cd->busy = FALSE;
+    player_kick(cd);
+}
+
+/* Issue the next pending command of the player unless one is in flight */
+static void player_kick(cd_t *cd)
+{
+    command_t *cmd;
+    const gchar *method;
+
+    if (cd->busy || !cd->active)
+        return;
+
+    cmd = g_queue_peek_head(&cd->pending);
+    if (cmd == NULL)
+        return;
+
+    if (cmd->transport != TRANSPORT_NONE) {
+        method = (cmd->transport == TRANSPORT_PLAY) ? "Play" :
+                 (cmd->transport == TRANSPORT_PAUSE) ? "Pause" : "PlayPause";
+    }
+    else if (cmd->skip > 0) {
+        method = "Next";
+        cmd->skip--;
+    }
+    else {
+        method = "Previous";
+        cmd->skip++;
+    }
+    /* A skip stays queued until every press of it went out */
+    if (cmd->skip == 0)
+        g_free(g_queue_pop_head(&cd->pending));
+
+    cd->busy = TRUE;
+    g_dbus_connection_call(g_dbus_proxy_get_connection(session), cd->bus_name,
+                           MPRIS_PATH, MPRIS_PLAYER, method, NULL, NULL,
+                           G_DBUS_CALL_FLAGS_NONE, MPRIS_TIMEOUT, NULL,
+                           player_call_done, cd);
+}
+
+/* Queue a transport command or a skip, merging it with the last command */
+static void player_queue(cd_t *cd, transport_t transport, gint skip)
+{
+    command_t *last = g_queue_peek_tail(&cd->pending);
+
+    if ((transport == TRANSPORT_NONE) && (skip == 0))
+        return;
+
+    if ((last != NULL) && ((last->transport == TRANSPORT_NONE) == (transport == TRANSPORT_NONE))) {
+        if (transport == TRANSPORT_NONE)
+            last->skip += skip;
+        else if (transport != TRANSPORT_PLAY_PAUSE)
+            last->transport = transport;
+        else if (last->transport == TRANSPORT_PLAY)
+            last->transport = TRANSPORT_PAUSE;
+        else if (last->transport == TRANSPORT_PAUSE)
+            last->transport = TRANSPORT_PLAY;
+        else
+            last->transport = TRANSPORT_NONE;
+
+        if ((last->transport == TRANSPORT_NONE) && (last->skip == 0))
+            g_free(g_queue_pop_tail(&cd->pending));
+    }
+    else {
+        last = g_new(command_t, 1);
+        last->transport = transport;
+        last->skip = skip;
+        g_queue_push_tail(&cd->pending, last);
+    }
+    player_kick(cd);
+}
+
+static void player_transport(cd_t *cd, transport_t transport)
+{
+    player_queue(cd, transport, 0);
+}
+
+static void player_skip(cd_t *cd, gint tracks)
+{
+    player_queue(cd, TRANSPORT_NONE, tracks);
+}
+
 void ikbus_play(IKBusCdc *cdc, gpointer data)
 {
     if (cd_changer.current_cd != NULL)
-        playerctl_player_play(cd_changer.current_cd->mpris, NULL);
+        player_transport(cd_changer.current_cd, TRANSPORT_PLAY);
 }
 
 void ikbus_stop(IKBusCdc *cdc, gpointer data)
 {
     if (cd_changer.current_cd != NULL)
-        playerctl_player_pause(cd_changer.current_cd->mpris, NULL);
+        player_transport(cd_changer.current_cd, TRANSPORT_PAUSE);
 }
 
 void ikbus_next(IKBusCdc *cdc, gpointer data)
 {
     if (cd_changer.current_cd != NULL)
-        playerctl_player_next(cd_changer.current_cd->mpris, NULL);
+        player_skip(cd_changer.current_cd, 1);
 }
 
 void ikbus_previous(IKBusCdc *cdc, gpointer data)
 {
     if (cd_changer.current_cd != NULL)
-        playerctl_player_previous(cd_changer.current_cd->mpris, NULL);
+        player_skip(cd_changer.current_cd, -1);
 }
 
-void ikbus_ch_disc(IKBusCdc *cdc,gpointer arg, gpointer data)
+void ikbus_ch_disc(IKBusCdc *cdc, guchar arg, gpointer data)
 {
-    PlayerctlPlayer *mpris = cd_changer.current_cd->mpris;
-    guint cdnum = ikbus_cdc_get_cmd_arg(cd_changer.cdc);
+    gint cdnum = ikbus_cdc_get_requested_cd(cd_changer.cdc);
+
+    if ((cd_changer.current_cd == NULL) || (cdnum < 1) || ((guint) cdnum > cd_changer.magazine_size))
+        return;
 
     if (cd_changer.current_cd->number == cdnum) {
-        playerctl_player_play_pause(cd_changer.current_cd->mpris, NULL);
+        player_transport(cd_changer.current_cd, TRANSPORT_PLAY_PAUSE);
         return;
     }
 
     if (cd_changer.magazine[cdnum -1].active == TRUE) {
-        playerctl_player_pause(cd_changer.current_cd->mpris, NULL);
+        player_transport(cd_changer.current_cd, TRANSPORT_PAUSE);
         cd_changer.current_cd = &cd_changer.magazine[cdnum -1];
-        playerctl_player_play(cd_changer.current_cd->mpris, NULL);
+        player_transport(cd_changer.current_cd, TRANSPORT_PLAY);
         ikbus_cdc_set_cd (cd_changer.cdc, cdnum);
         ikbus_cdc_sync_output(cd_changer.cdc, NULL);
     }
 
 }
 
-static gboolean player_have_mpris(const gchar* player_name)
+/* Attach configured players found in the reply to ListNames */
+static void list_names_done(GObject *source, GAsyncResult *res, gpointer data)
 {
+    GError *error = NULL;
     GVariant *reply;
-    GVariant *reply_child;
-    const gchar **names;
-    gchar *player_bus_name;
-    guint i;
-    gsize reply_count;
-    gboolean ret = FALSE;
-
-    if (session == NULL)
-        return ret;
-
-    reply = g_dbus_proxy_call_sync(session, "ListNames", NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
-    if (reply == NULL)
-        return ret;
-
-    player_bus_name = g_strjoin(".", "org.mpris.MediaPlayer2", player_name, NULL);
-    reply_child = g_variant_get_child_value(reply, 0);
-    names = g_variant_get_strv(reply_child, &reply_count);
-    for (i = 0; i < reply_count; i += 1) {
-        if (g_strcmp0(names[i], player_bus_name) == 0) {
-            ret = TRUE;
-            break;
-        }
+    GVariantIter *iter;
+    const gchar *name;
+    cd_t *cd;
+
+    reply = g_dbus_proxy_call_finish(G_DBUS_PROXY(source), res, &error);
+    if (reply == NULL) {
+        g_warning("ListNames: %s\n", error->message);
+        g_error_free(error);
+        return;
     }
-    g_variant_unref(reply);
-    g_variant_unref(reply_child);
-    g_free(names);
-    g_free(player_bus_name);
 
-    return ret;
+    g_variant_get(reply, "(as)", &iter);
+    while (g_variant_iter_next(iter, "&s", &name)) {
+        cd = g_hash_table_lookup(players, name);
+        if ((cd != NULL) && (cd->active != TRUE))
+            attach_player_to_cd(cd->mpris_name, cd);
+    }
+    g_variant_iter_free(iter);
+    ikbus_cdc_sync_output(cd_changer.cdc, NULL);
+
+    g_variant_unref(reply);
 }
 
-static void dbus_signal (GDBusProxy *proxy,
-           gchar      *sender_name,
-           gchar      *signal_name,
-           GVariant   *parameters,
-           gpointer    user_data)
+/* NameOwnerChanged, matched by the bus for names under MPRIS_NAMESPACE only */
+static void dbus_signal (GDBusConnection *connection,
+           const gchar *sender_name,
+           const gchar *object_path,
+           const gchar *interface_name,
+           const gchar *signal_name,
+           GVariant    *parameters,
+           gpointer     user_data)
 {
-  gchar *bus_name, *old, *new, *player_name;
-  gchar **split_bus_name;
+  const gchar *bus_name, *old, *new;
   cd_t *cd;
 
-  if ((g_strcmp0(signal_name, "NameOwnerChanged") != 0) || (!g_variant_is_of_type(parameters ,G_VARIANT_TYPE ("(sss)"))))
-      return;
-
-  g_variant_get(parameters, "(sss)", &bus_name, &old, &new);
-  if (!g_str_has_prefix(bus_name, "org.mpris.MediaPlayer2."))
+  if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE ("(sss)")))
       return;
 
-  split_bus_name = g_strsplit(bus_name, ".", 4);
-  player_name = g_strdup(split_bus_name[3]);
-  cd = find_cd_by_player_name(player_name);
+  g_variant_get(parameters, "(&s&s&s)", &bus_name, &old, &new);
+  cd = g_hash_table_lookup(players, bus_name);
   if (cd == NULL)
-      goto free;
+      return;
 
   if (*new == '\0') {
       /*remove player*/
       deatach_player(cd);
-      
   }
   else {
       /*add player*/
-      attach_player_to_cd(player_name, cd);
+      attach_player_to_cd(cd->mpris_name, cd);
   }
   ikbus_cdc_sync_output(cd_changer.cdc, NULL);
+}
 
-  //ikbus_cdc_sync_output(cd_changer.cdc, NULL);
-free:
-  g_free (bus_name); 
-  g_free (old); 
-  g_free (new);
-  g_free (player_name);
+/* SIGUSR2 prints bus statistics */
+static gboolean print_stats(gpointer data)
+{
+    static const gchar * const drop_names[IKBUS_CDC_DROP_LAST] = {
+        "too short", "bad length", "bad checksum", "not for us",
+        "unknown message", "unknown command",
+    };
+    guint64 hits, misses;
+    guint i;
+
+    ikbus_cdc_get_cache_stats(cd_changer.cdc, &hits, &misses);
+    g_print("CD status cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses\n",
+            hits, misses);
+    for (i = 0; i < IKBUS_CDC_DROP_LAST; i++)
+        g_print("Dropped, %s: %" G_GUINT64_FORMAT "\n", drop_names[i],
+                ikbus_cdc_get_drop_count(cd_changer.cdc, i));
+    return G_SOURCE_CONTINUE;
+}
+
+/* SIGUSR1 starts or stops capturing bus traffic */
+static gboolean toggle_capture(gpointer data)
+{
+    IKBusSocket *sock = ikbus_cdc_get_socket(cd_changer.cdc);
+    const gchar *file = capture_file ? capture_file : DEFAULT_CAPTURE_FILE;
+    GError *error = NULL;
+
+    if (ikbus_socket_is_capturing(sock)) {
+        ikbus_socket_capture_stop(sock);
+        g_print("Capture to %s stopped\n", file);
+    }
+    else if (ikbus_socket_capture_start(sock, file, &error)) {
+        g_print("Capturing to %s\n", file);
+    }
+    else {
+        g_warning("%s\n", error->message);
+        g_error_free(error);
+    }
+    return G_SOURCE_CONTINUE;
 }
 
 int main(int argc, char **argv)
 {
     GError *error = NULL;
     gchar *conf_file;
-    guint i;
-
 
     /* Load configure */
     conf_file = g_build_filename(g_get_home_dir(),".config", "cdc", CONFIG_NAME, NULL);
@@ -382,15 +629,24 @@ int main(int argc, char **argv)
     g_free(conf_file);
 
     /* Init CDC device connected to I/K-bus */
-    cd_changer.cdc = ikbus_cdc_new("ibus0", &error);
+    cd_changer.cdc = g_initable_new(IKBUS_TYPE_CDC, NULL, &error,
+                                    "ifname", ifname ? ifname : DEFAULT_IFNAME,
+                                    "io-thread", io_thread,
+                                    "head-unit", head_unit,
+                                    "announce-interval", announce_interval,
+                                    "tx-gap", tx_gap, NULL);
     if (cd_changer.cdc == NULL) {
         g_critical("IKBus: %s\n", error->message);
         return -1;
     }
 
-    /*Connect to org.freedesktop.DBus*/
+    /*
+     * Connect to org.freedesktop.DBus, without the proxy's own match rule
+     * for all its signals; only MPRIS names are subscribed below.
+     */
     session = g_dbus_proxy_new_for_bus_sync(G_BUS_TYPE_SESSION,
-                                            G_DBUS_PROXY_FLAGS_NONE,
+                                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                            G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
                                             NULL,
                                             "org.freedesktop.DBus",
                                             "/org/freedesktop/DBus",
@@ -401,22 +657,19 @@ int main(int argc, char **argv)
         g_critical("Dbus: %s\n", error->message);
         return -1;
     }
-    g_signal_connect (session, "g-signal", G_CALLBACK (dbus_signal), NULL);
+    g_dbus_connection_signal_subscribe(g_dbus_proxy_get_connection(session),
+                                       "org.freedesktop.DBus",
+                                       "org.freedesktop.DBus",
+                                       "NameOwnerChanged",
+                                       "/org/freedesktop/DBus",
+                                       MPRIS_NAMESPACE,
+                                       G_DBUS_SIGNAL_FLAGS_MATCH_ARG0_NAMESPACE,
+                                       dbus_signal, NULL, NULL);
 
     /* Attach MPRIS2 interfaces to control */
     ikbus_cdc_set_error (cd_changer.cdc, CDC_ERR_NO_DISCS);
-    for (i = 0; i < MAGAZINE_SIZE; i++) {
-        if (cd_changer.magazine[i].mpris_name != NULL) {
-            cd_changer.magazine[i].mpris = playerctl_player_new(cd_changer.magazine[i].mpris_name, &error);
-            if (cd_changer.magazine[i].mpris == NULL) {
-                g_warning("playerctl: %s\n", error->message);
-                continue;
-            }
-            if (player_have_mpris(cd_changer.magazine[i].mpris_name) == TRUE) {
-                attach_player_to_cd(cd_changer.magazine[i].mpris_name, &cd_changer.magazine[i]);
-            }
-        }
-    }
+    g_dbus_proxy_call(session, "ListNames", NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                      list_names_done, NULL);
 
     /* Signals from I/K-bus from automotive ECU */
     g_signal_connect(G_OBJECT (cd_changer.cdc), "play", G_CALLBACK (ikbus_play), NULL);
@@ -425,6 +678,9 @@ int main(int argc, char **argv)
     g_signal_connect(G_OBJECT (cd_changer.cdc), "previous", G_CALLBACK (ikbus_previous), NULL);
     g_signal_connect(G_OBJECT (cd_changer.cdc), "change-disc", G_CALLBACK (ikbus_ch_disc), NULL);
 
+    g_unix_signal_add(SIGUSR1, toggle_capture, NULL);
+    g_unix_signal_add(SIGUSR2, print_stats, NULL);
+
     loop = g_main_loop_new(NULL, FALSE);
     g_main_loop_run(loop);
 
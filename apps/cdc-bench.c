@@ -0,0 +1,413 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CDC latency benchmark. Plays the radio on a simulated bus: sends CD_CTL
+ * commands to an in-process IKBusCdc at a fixed rate and measures the time
+ * until the matching CD_STAT reply. The rate is raised step by step until
+ * replies start to come late or not at all.
+ *
+ * With --pty the changer talks to the radio through the tty: transport on
+ * a pseudo-terminal pair, the way it does on a USB-serial transceiver.
+ */
+
+#define _GNU_SOURCE
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ikbusdefs.h"
+#include "ikbuscdc.h"
+#include "ikbussync.h"
+
+#define OUTSTANDING_MAX 65536
+
+enum {
+    MIX_STAT,
+    MIX_PLAY,
+    MIX_TRACK,
+    MIX_DISC,
+    MIX_LAST
+};
+
+static gint rate = 50;              /* commands per second */
+static gint rate_step = 0;
+static gint max_rate = 20000;
+static gint step_time = 5;          /* s */
+static gint timeout_ms = 100;
+static gint seed = 1;
+static gchar *mix_str = NULL;
+static gboolean io_thread = FALSE;
+static gboolean use_pty = FALSE;
+
+static GOptionEntry entries[] = {
+    { "rate", 'r', 0, G_OPTION_ARG_INT, &rate, "Initial command rate, frames/s", "N" },
+    { "rate-step", 's', 0, G_OPTION_ARG_INT, &rate_step, "Rate increase per step (default: initial rate)", "N" },
+    { "max-rate", 'm', 0, G_OPTION_ARG_INT, &max_rate, "Stop ramping at this rate", "N" },
+    { "step-time", 't', 0, G_OPTION_ARG_INT, &step_time, "Duration of each step, s", "S" },
+    { "timeout", 'T', 0, G_OPTION_ARG_INT, &timeout_ms, "Reply deadline of the radio, ms", "MS" },
+    { "mix", 'x', 0, G_OPTION_ARG_STRING, &mix_str, "Command weights, e.g. stat:70,play:10,track:15,disc:5", "MIX" },
+    { "seed", 0, 0, G_OPTION_ARG_INT, &seed, "Random seed for the command mix", "N" },
+    { "io-thread", 'i', 0, G_OPTION_ARG_NONE, &io_thread, "Serve the bus from the socket I/O thread", NULL },
+    { "pty", 'p', 0, G_OPTION_ARG_NONE, &use_pty, "Connect through a pseudo-terminal and the tty: transport", NULL },
+    { NULL }
+};
+
+static struct {
+    IKBusCdc *cdc;
+    gint fd;                        /* Radio end of the simulated bus */
+    IKBusSync *sync;                /* Framing of the pseudo-terminal */
+    GSource *tx_source;
+    GRand *rand;
+    guint mix[MIX_LAST];
+    guint mix_total;
+
+    gint64 interval;                /* us between commands */
+    gint64 next_send;
+    gint64 step_end;
+
+    gint64 outstanding[OUTSTANDING_MAX];
+    guint out_head;
+    guint out_count;
+
+    GArray *latencies;
+    guint sent;
+    guint dropped;
+} radio;
+
+static GMainLoop *loop;
+
+static gboolean parse_mix(const gchar *str)
+{
+    static const gchar * const names[MIX_LAST] = { "stat", "play", "track", "disc" };
+    gchar **items;
+    guint i, j;
+    gboolean ret = TRUE;
+
+    radio.mix[MIX_STAT] = 70;
+    radio.mix[MIX_PLAY] = 10;
+    radio.mix[MIX_TRACK] = 15;
+    radio.mix[MIX_DISC] = 5;
+    if (str != NULL) {
+        memset(radio.mix, 0, sizeof(radio.mix));
+        items = g_strsplit(str, ",", -1);
+        for (i = 0; items[i] != NULL; i++) {
+            gchar **kv = g_strsplit(items[i], ":", 2);
+            for (j = 0; j < MIX_LAST; j++)
+                if ((kv[0] != NULL) && (kv[1] != NULL) && (g_strcmp0(kv[0], names[j]) == 0))
+                    break;
+            if (j == MIX_LAST)
+                ret = FALSE;
+            else
+                radio.mix[j] = (guint) g_ascii_strtoull(kv[1], NULL, 10);
+            g_strfreev(kv);
+        }
+        g_strfreev(items);
+    }
+
+    radio.mix_total = 0;
+    for (i = 0; i < MIX_LAST; i++)
+        radio.mix_total += radio.mix[i];
+
+    return ret && (radio.mix_total > 0);
+}
+
+static void send_command(gint64 now)
+{
+    guint8 frame[] = {IKBUS_DEV_RAD, 0x05, IKBUS_DEV_CDC, IKBUS_MSG_CD_CTL, 0x00, 0x00, 0x00};
+    guint pick, i;
+
+    pick = g_rand_int_range(radio.rand, 0, radio.mix_total);
+    for (i = 0; pick >= radio.mix[i]; i++)
+        pick -= radio.mix[i];
+
+    switch (i) {
+    case MIX_STAT:
+        frame[4] = CDC_CMD_STAT_REQ;
+        break;
+    case MIX_PLAY:
+        frame[4] = CDC_CMD_PLAY;
+        break;
+    case MIX_TRACK:
+        frame[4] = CDC_CMD_CHNG_TR;
+        frame[5] = g_rand_boolean(radio.rand);
+        break;
+    case MIX_DISC:
+        frame[4] = CDC_CMD_CHNG_CD;
+        frame[5] = g_rand_int_range(radio.rand, 1, 7);
+        break;
+    }
+
+    /* Frames read from the bus carry the XOR checksum */
+    for (i = 0; i < sizeof(frame) - 1; i++)
+        frame[sizeof(frame) - 1] ^= frame[i];
+
+    if (write(radio.fd, frame, sizeof(frame)) < 0) {
+        radio.dropped++;
+        return;
+    }
+
+    if (radio.out_count == OUTSTANDING_MAX) {
+        radio.dropped++;
+        return;
+    }
+    radio.outstanding[(radio.out_head + radio.out_count) % OUTSTANDING_MAX] = now;
+    radio.out_count++;
+    radio.sent++;
+}
+
+static gboolean radio_tx(GSource *source, GSourceFunc callback, gpointer data)
+{
+    gint64 now = g_get_monotonic_time();
+
+    while (radio.next_send <= now) {
+        send_command(now);
+        radio.next_send += radio.interval;
+    }
+
+    if (now >= radio.step_end) {
+        g_source_set_ready_time(source, -1);
+        g_main_loop_quit(loop);
+        return G_SOURCE_CONTINUE;
+    }
+
+    g_source_set_ready_time(source, radio.next_send);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs radio_tx_funcs = {
+    NULL,
+    NULL,
+    radio_tx,
+    NULL,
+};
+
+/* Next frame from the changer, a pseudo-terminal is a plain byte stream */
+static gssize radio_read(guint8 *buf)
+{
+    guint8 chunk[64];
+    gssize n;
+    gint len;
+
+    if (radio.sync == NULL)
+        return read(radio.fd, buf, IKBUS_MAX_FRAME_SIZE);
+
+    while ((len = ikbus_sync_pop(radio.sync, buf)) == 0) {
+        n = read(radio.fd, chunk, MIN(sizeof(chunk), ikbus_sync_get_space(radio.sync)));
+        if (n <= 0)
+            return n;
+        ikbus_sync_push(radio.sync, chunk, n);
+    }
+    return len;
+}
+
+static gboolean radio_rx(gint fd, GIOCondition condition, gpointer data)
+{
+    guint8 buf[IKBUS_MAX_FRAME_SIZE];
+    gint64 now, sent_at, latency;
+    gssize n;
+
+    while ((n = radio_read(buf)) > 0) {
+        if ((n <= IKBUS_FRM_CMD) || (buf[IKBUS_FRM_CMD] != IKBUS_MSG_CD_STAT))
+            continue;
+        if (radio.out_count == 0)
+            continue;
+
+        now = g_get_monotonic_time();
+        sent_at = radio.outstanding[radio.out_head];
+        radio.out_head = (radio.out_head + 1) % OUTSTANDING_MAX;
+        radio.out_count--;
+
+        latency = now - sent_at;
+        if (latency > (gint64) timeout_ms * 1000)
+            radio.dropped++;
+        else
+            g_array_append_val(radio.latencies, latency);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Emulate a player that reacts at once, as cdc-agent does after settling */
+static void player_next(IKBusCdc *cdc, gpointer data)
+{
+    ikbus_cdc_set_track(cdc, ikbus_cdc_get_track(cdc) + 1);
+    ikbus_cdc_sync_output(cdc, NULL);
+}
+
+static void player_previous(IKBusCdc *cdc, gpointer data)
+{
+    ikbus_cdc_set_track(cdc, MAX(ikbus_cdc_get_track(cdc) - 1, 1));
+    ikbus_cdc_sync_output(cdc, NULL);
+}
+
+static void player_disc(IKBusCdc *cdc, guchar arg, gpointer data)
+{
+    ikbus_cdc_set_cd(cdc, arg);
+    ikbus_cdc_sync_output(cdc, NULL);
+}
+
+static gint compare_latency(gconstpointer a, gconstpointer b)
+{
+    gint64 la = *(const gint64 *) a;
+    gint64 lb = *(const gint64 *) b;
+
+    return (la > lb) - (la < lb);
+}
+
+static gint64 percentile(GArray *sorted, gdouble p)
+{
+    guint idx;
+
+    if (sorted->len == 0)
+        return 0;
+    idx = (guint) (p * (sorted->len - 1) + 0.5);
+    return g_array_index(sorted, gint64, idx);
+}
+
+/* Run one step at the given rate, returns TRUE if no reply was lost */
+static gboolean run_step(gint step_rate)
+{
+    gint64 now;
+
+    radio.interval = G_USEC_PER_SEC / step_rate;
+    radio.sent = 0;
+    radio.dropped = 0;
+    radio.out_head = 0;
+    radio.out_count = 0;
+    g_array_set_size(radio.latencies, 0);
+
+    now = g_get_monotonic_time();
+    radio.next_send = now;
+    radio.step_end = now + (gint64) step_time * G_USEC_PER_SEC;
+    g_source_set_ready_time(radio.tx_source, now);
+    g_main_loop_run(loop);
+
+    /* Collect late replies, anything still missing after that is lost */
+    now = g_get_monotonic_time() + (gint64) timeout_ms * 1000;
+    while ((radio.out_count > 0) && (g_get_monotonic_time() < now))
+        g_main_context_iteration(NULL, FALSE);
+    radio.dropped += radio.out_count;
+
+    g_array_sort(radio.latencies, compare_latency);
+    g_print("%6d cmd/s  sent %7u  lost %5u  p50 %6" G_GINT64_FORMAT " us"
+            "  p99 %6" G_GINT64_FORMAT " us  p999 %6" G_GINT64_FORMAT " us\n",
+            step_rate, radio.sent, radio.dropped,
+            percentile(radio.latencies, 0.50),
+            percentile(radio.latencies, 0.99),
+            percentile(radio.latencies, 0.999));
+
+    return radio.dropped == 0;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    gchar *ifname;
+    gint fds[2];
+    gint step_rate, sustained = 0;
+    guint i;
+
+    context = g_option_context_new("- CDC reply latency benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return -1;
+    }
+    g_option_context_free(context);
+
+    if ((rate <= 0) || (step_time <= 0) || !parse_mix(mix_str)) {
+        g_printerr("Invalid benchmark parameters\n");
+        return -1;
+    }
+    if (rate_step <= 0)
+        rate_step = rate;
+
+    /* Simulated bus between the radio and the changer */
+    if (use_pty) {
+        fds[0] = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if ((fds[0] < 0) || (grantpt(fds[0]) < 0) || (unlockpt(fds[0]) < 0)) {
+            g_printerr("pseudo-terminal: %s\n", g_strerror(errno));
+            return -1;
+        }
+        radio.sync = ikbus_sync_new();
+        ifname = g_strdup_printf("tty:%s", ptsname(fds[0]));
+    }
+    else {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+            g_printerr("socketpair: %s\n", g_strerror(errno));
+            return -1;
+        }
+        ifname = g_strdup_printf("fd:%d", fds[1]);
+    }
+    g_unix_set_fd_nonblocking(fds[0], TRUE, NULL);
+    radio.fd = fds[0];
+
+    radio.cdc = g_initable_new(IKBUS_TYPE_CDC, NULL, &error,
+                               "ifname", ifname, "io-thread", io_thread, NULL);
+    g_free(ifname);
+    if (!use_pty)
+        close(fds[1]);
+    if (radio.cdc == NULL) {
+        g_printerr("IKBus: %s\n", error->message);
+        return -1;
+    }
+
+    for (i = 1; i <= 6; i++)
+        ikbus_cdc_insert_cd(radio.cdc, i);
+    ikbus_cdc_set_cd(radio.cdc, 1);
+    ikbus_cdc_set_track(radio.cdc, 1);
+    g_signal_connect(G_OBJECT (radio.cdc), "next", G_CALLBACK (player_next), NULL);
+    g_signal_connect(G_OBJECT (radio.cdc), "previous", G_CALLBACK (player_previous), NULL);
+    g_signal_connect(G_OBJECT (radio.cdc), "change-disc", G_CALLBACK (player_disc), NULL);
+
+    radio.rand = g_rand_new_with_seed(seed);
+    radio.latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+    loop = g_main_loop_new(NULL, FALSE);
+
+    radio.tx_source = g_source_new(&radio_tx_funcs, sizeof(GSource));
+    g_source_attach(radio.tx_source, NULL);
+    g_unix_fd_add(radio.fd, G_IO_IN, radio_rx, NULL);
+
+    for (step_rate = rate; step_rate <= max_rate; step_rate += rate_step) {
+        if (!run_step(step_rate))
+            break;
+        sustained = step_rate;
+    }
+
+    if (sustained > 0)
+        g_print("Highest sustained rate: %d cmd/s\n", sustained);
+    else
+        g_print("Replies were lost already at %d cmd/s\n", rate);
+
+    g_object_unref(radio.cdc);
+    g_rand_free(radio.rand);
+    g_array_free(radio.latencies, TRUE);
+    g_main_loop_unref(loop);
+    ikbus_sync_free(radio.sync);
+    close(radio.fd);
+
+    return 0;
+}
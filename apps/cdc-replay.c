@@ -0,0 +1,344 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CDC trace replay. Feeds the frames a changer received in a capture file
+ * (see ikbus_socket_capture_start()) to an in-process IKBusCdc over a
+ * simulated bus and compares its replies with the ones recorded.
+ *
+ * Before each received frame the changer is put into the state of the last
+ * recorded CD status, so every frame is checked on its own and frames sent
+ * by the agent for reasons of its own do not throw the replay off. Replies
+ * are the frames recorded within the reply window after a received frame;
+ * announces are left out unless the frame was a status request.
+ */
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ikbusdefs.h"
+#include "ikbuscdc.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_SIZE 16
+#define CDC_STAT_SIZE 11
+
+typedef struct {
+    gint64 time;                    /* us since the start of the capture */
+    guint8 direction;               /* IKBUS_CAPTURE_RX or IKBUS_CAPTURE_TX */
+    gint nbytes;
+    const guint8 *data;
+} record_t;
+
+static gboolean realtime = FALSE;
+static gint window_ms = 50;
+static gint repeat = 1;
+static gint max_diffs = 20;
+static gboolean quiet = FALSE;
+
+static GOptionEntry entries[] = {
+    { "realtime", 'r', 0, G_OPTION_ARG_NONE, &realtime, "Keep the recorded timing instead of replaying as fast as possible", NULL },
+    { "window", 'w', 0, G_OPTION_ARG_INT, &window_ms, "Recorded frames up to this long after a received frame are its reply, ms", "MS" },
+    { "repeat", 'n', 0, G_OPTION_ARG_INT, &repeat, "Replay the capture this many times", "N" },
+    { "max-diffs", 'd', 0, G_OPTION_ARG_INT, &max_diffs, "Print at most this many mismatches", "N" },
+    { "quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet, "Only print the summary", NULL },
+    { NULL }
+};
+
+static struct {
+    IKBusCdc *cdc;
+    gint fd;                        /* Radio end of the simulated bus */
+    GArray *records;
+    guint frames;
+    guint mismatches;
+} replay;
+
+static guint32 swap32(guint32 v)
+{
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+/* Split the capture into records, the data stays in the file buffer */
+static gboolean load_capture(const gchar *contents, gsize length, GError **error)
+{
+    const guint8 *p = (const guint8 *) contents;
+    guint32 hdr[6], rec[4];
+    gboolean swapped;
+    gint64 first = -1, t;
+    record_t r;
+    guint i;
+
+    if (length < PCAP_HEADER_SIZE) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Not a pcap file");
+        return FALSE;
+    }
+    memcpy(hdr, p, PCAP_HEADER_SIZE);
+    swapped = (hdr[0] == swap32(PCAP_MAGIC));
+    if (swapped)
+        for (i = 0; i < G_N_ELEMENTS(hdr); i++)
+            hdr[i] = swap32(hdr[i]);
+    if (hdr[0] != PCAP_MAGIC) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Not a pcap file");
+        return FALSE;
+    }
+    if (hdr[5] != IKBUS_CAPTURE_LINKTYPE) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "Link type %u is not an I/K-bus capture", hdr[5]);
+        return FALSE;
+    }
+
+    replay.records = g_array_new(FALSE, FALSE, sizeof(record_t));
+    p += PCAP_HEADER_SIZE;
+    length -= PCAP_HEADER_SIZE;
+    while (length >= PCAP_RECORD_SIZE) {
+        memcpy(rec, p, PCAP_RECORD_SIZE);
+        if (swapped)
+            for (i = 0; i < G_N_ELEMENTS(rec); i++)
+                rec[i] = swap32(rec[i]);
+        if ((rec[2] > length - PCAP_RECORD_SIZE) || (rec[2] < 2) ||
+            (rec[2] > IKBUS_MAX_FRAME_SIZE + 1)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        "Broken record %u", replay.records->len);
+            return FALSE;
+        }
+
+        t = (gint64) rec[0] * G_USEC_PER_SEC + rec[1];
+        if (first < 0)
+            first = t;
+        r.time = t - first;
+        r.direction = p[PCAP_RECORD_SIZE];
+        r.nbytes = rec[2] - 1;
+        r.data = p + PCAP_RECORD_SIZE + 1;
+        g_array_append_val(replay.records, r);
+
+        p += PCAP_RECORD_SIZE + rec[2];
+        length -= PCAP_RECORD_SIZE + rec[2];
+    }
+
+    return TRUE;
+}
+
+static gboolean is_announce(const guint8 *data, gint nbytes)
+{
+    return (nbytes > IKBUS_FRM_CMD) && (data[IKBUS_FRM_CMD] == IKBUS_MSG_DEV_STAT_READY);
+}
+
+static gboolean is_reply(const record_t *rx, const guint8 *data, gint nbytes)
+{
+    if (!is_announce(data, nbytes))
+        return TRUE;
+    return rx->data[IKBUS_FRM_CMD] == IKBUS_MSG_DEV_STAT_REQ;
+}
+
+/* Put the changer into the state reported by a recorded CD status */
+static void sync_state(const record_t *stat)
+{
+    const guint8 *d = stat->data;
+    guint i;
+
+    for (i = 1; i <= IKBUS_CDC_PAGE_SIZE; i++) {
+        if (d[7] & (1 << (i - 1)))
+            ikbus_cdc_insert_cd(replay.cdc, i);
+        else
+            ikbus_cdc_remove_cd(replay.cdc, i);
+    }
+    ikbus_cdc_set_cd(replay.cdc, d[9]);
+    ikbus_cdc_set_track(replay.cdc, (d[10] >> 4) * 10 + (d[10] & 0x0f));
+    ikbus_cdc_set_resp_status(replay.cdc, d[4]);
+    ikbus_cdc_set_resp_request(replay.cdc, d[5]);
+    ikbus_cdc_set_error(replay.cdc, d[6]);
+}
+
+static void print_frame(const gchar *what, const guint8 *data, gint nbytes)
+{
+    gint i;
+
+    g_print("  %-8s", what);
+    for (i = 0; i < nbytes; i++)
+        g_print(" %02X", data[i]);
+    g_print("\n");
+}
+
+/* Let the changer handle everything pending and collect what it sent */
+static guint collect_replies(const record_t *rx, guint8 (*out)[IKBUS_MAX_FRAME_SIZE],
+                             gint *out_len, guint max)
+{
+    guint8 buf[IKBUS_MAX_FRAME_SIZE];
+    guint n = 0;
+    gssize len;
+
+    do {
+        while (g_main_context_iteration(NULL, FALSE))
+            ;
+        len = read(replay.fd, buf, sizeof(buf));
+        if ((len > 0) && is_reply(rx, buf, len) && (n < max)) {
+            memcpy(out[n], buf, len);
+            out_len[n++] = len;
+        }
+    } while (len > 0);
+
+    return n;
+}
+
+/* Replay the capture once, returns the number of received frames fed */
+static guint replay_once(void)
+{
+    guint8 got[16][IKBUS_MAX_FRAME_SIZE];
+    gint got_len[16];
+    const record_t *rx, *stat = NULL, *next;
+    gint64 start, deadline;
+    guint i, j, k, ngot, nexp, fed = 0;
+    gboolean match;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < replay.records->len; i++) {
+        rx = &g_array_index(replay.records, record_t, i);
+        if (rx->direction != IKBUS_CAPTURE_RX) {
+            if ((rx->nbytes >= CDC_STAT_SIZE) && (rx->data[IKBUS_FRM_CMD] == IKBUS_MSG_CD_STAT))
+                stat = rx;
+            continue;
+        }
+        if (rx->nbytes <= IKBUS_FRM_CMD)
+            continue;
+
+        if (realtime) {
+            deadline = start + rx->time;
+            while (g_get_monotonic_time() < deadline)
+                if (!g_main_context_iteration(NULL, FALSE))
+                    g_usleep(100);
+        }
+
+        if (stat != NULL)
+            sync_state(stat);
+        collect_replies(rx, got, got_len, 0);
+
+        if (write(replay.fd, rx->data, rx->nbytes) < 0) {
+            g_printerr("write: %s\n", g_strerror(errno));
+            break;
+        }
+        fed++;
+        ngot = collect_replies(rx, got, got_len, G_N_ELEMENTS(got));
+
+        /* Recorded replies: frames sent within the window, up to the next frame received */
+        nexp = 0;
+        match = TRUE;
+        for (j = i + 1; j < replay.records->len; j++) {
+            next = &g_array_index(replay.records, record_t, j);
+            if ((next->direction == IKBUS_CAPTURE_RX) ||
+                (next->time - rx->time > (gint64) window_ms * 1000))
+                break;
+            if (!is_reply(rx, next->data, next->nbytes))
+                continue;
+            if ((nexp >= ngot) || (got_len[nexp] != next->nbytes) ||
+                memcmp(got[nexp], next->data, next->nbytes))
+                match = FALSE;
+            nexp++;
+        }
+        if (nexp != ngot)
+            match = FALSE;
+
+        if (match)
+            continue;
+
+        replay.mismatches++;
+        if (quiet || (replay.mismatches > (guint) max_diffs))
+            continue;
+        g_print("Frame %u at %" G_GINT64_FORMAT ".%06" G_GINT64_FORMAT " s:\n",
+                i, rx->time / G_USEC_PER_SEC, rx->time % G_USEC_PER_SEC);
+        print_frame("received", rx->data, rx->nbytes);
+        for (k = i + 1; k < j; k++) {
+            next = &g_array_index(replay.records, record_t, k);
+            if (is_reply(rx, next->data, next->nbytes))
+                print_frame("expected", next->data, next->nbytes);
+        }
+        for (k = 0; k < ngot; k++)
+            print_frame("got", got[k], got_len[k]);
+    }
+
+    return fed;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    gchar *contents, *ifname;
+    gsize length;
+    gint64 start, elapsed;
+    gint fds[2];
+    gint i;
+
+    context = g_option_context_new("CAPTURE - replay a CDC capture and check the replies");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return -1;
+    }
+    g_option_context_free(context);
+
+    if ((argc != 2) || (window_ms < 0) || (repeat < 1)) {
+        g_printerr("Usage: %s [OPTION...] CAPTURE\n", argv[0]);
+        return -1;
+    }
+
+    if (!g_file_get_contents(argv[1], &contents, &length, &error) ||
+        !load_capture(contents, length, &error)) {
+        g_printerr("%s: %s\n", argv[1], error->message);
+        return -1;
+    }
+
+    /* Simulated bus between the radio and the changer */
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        g_printerr("socketpair: %s\n", g_strerror(errno));
+        return -1;
+    }
+    g_unix_set_fd_nonblocking(fds[0], TRUE, NULL);
+    replay.fd = fds[0];
+
+    ifname = g_strdup_printf("fd:%d", fds[1]);
+    replay.cdc = ikbus_cdc_new(ifname, &error);
+    g_free(ifname);
+    close(fds[1]);
+    if (replay.cdc == NULL) {
+        g_printerr("IKBus: %s\n", error->message);
+        return -1;
+    }
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < repeat; i++)
+        replay.frames += replay_once();
+    elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    g_print("%u frames replayed, %u mismatches", replay.frames, replay.mismatches);
+    if (!realtime)
+        g_print(", %.0f frames/s", replay.frames * (gdouble) G_USEC_PER_SEC / elapsed);
+    g_print("\n");
+
+    g_object_unref(replay.cdc);
+    g_array_free(replay.records, TRUE);
+    g_free(contents);
+    close(replay.fd);
+
+    return (replay.mismatches == 0) ? 0 : 1;
+}
@@ -0,0 +1,402 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Offline analyzer for raw I/K-bus byte dumps taken by a sniffer. Frames
+ * are found the same way IKBusSync finds them: a frame starts where the
+ * length byte is plausible and the XOR over the frame is zero, otherwise
+ * one byte is skipped.
+ *
+ * The dump is mapped and cut into one chunk per thread. Each thread works
+ * through its chunk in blocks: the running XOR of a block is computed a
+ * 64-bit word at a time, after which the checksum of any candidate frame is
+ * a single comparison. A thread resynchronizes at the start of its chunk,
+ * which need not be where a scan of the whole dump would be. After the
+ * threads are done, the scan is carried on one chunk after the other from
+ * where the previous chunk left off, until it meets a position the thread
+ * of the next chunk went through as well. From there on both agree, so the
+ * results do not depend on the number of threads.
+ */
+
+#include <glib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "ikbusdefs.h"
+#include "ikbussync.h"
+
+#define BLOCK_SIZE 65536
+#define HEADS_MAX ((IKBUS_MAX_FRAME_SIZE / IKBUS_SYNC_MIN_FRAME) + 1)
+
+typedef struct {
+    guint64 offset;
+    guint8 size;
+} frame_index_t;
+
+typedef struct {
+    const guint8 *data;
+    gsize length;                   /* Of the whole dump */
+    gsize start, end;               /* Frames starting in [start, end) belong here */
+    gsize next;                     /* Where the scan went on after the chunk */
+    gsize first;                    /* Frames before this offset were dropped */
+
+    guint64 frames;
+    guint64 discarded;
+    guint64 dev_frames[256];        /* By sender */
+    guint64 dev_bytes[256];
+    guint64 (*cmd_frames)[256];     /* By sender and command */
+
+    frame_index_t heads[HEADS_MAX]; /* First frames, to meet the previous chunk */
+    guint nheads;
+    GArray *index;                  /* Every frame, if an index is written */
+} chunk_t;
+
+static gint threads = 0;
+static gchar *index_file = NULL;
+
+static GOptionEntry entries[] = {
+    { "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Number of threads (default: one per CPU)", "N" },
+    { "index", 'i', 0, G_OPTION_ARG_FILENAME, &index_file, "Write the offset, size, sender, receiver and command of every frame", "FILE" },
+    { NULL }
+};
+
+static const gchar *device_name(guint8 dev)
+{
+    switch (dev) {
+    case IKBUS_DEV_CDC: return "CDC";
+    case IKBUS_DEV_MID: return "MID";
+    case IKBUS_DEV_RAD: return "RAD";
+    case IKBUS_DEV_DIA: return "DIA";
+    case IKBUS_DEV_GLO: return "GLO";
+    case IKBUS_DEV_LOC: return "LOC";
+    default: return "";
+    }
+}
+
+/*
+ * px[i] = data[0] ^ ... ^ data[i - 1]. Eight bytes per step: within a word
+ * the XOR is spread upwards by doubling shifts, then the carry of the words
+ * before is added to every byte.
+ */
+static void prefix_xor(const guint8 *data, gsize len, guint8 *px)
+{
+    guint64 w, carry = 0;
+    guint8 acc;
+    gsize i = 0;
+
+    px[0] = 0;
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&w, data + i, 8);
+        w ^= w << 8;
+        w ^= w << 16;
+        w ^= w << 32;
+        w ^= carry;
+        memcpy(px + i + 1, &w, 8);
+        carry = (w >> 56) * G_GUINT64_CONSTANT(0x0101010101010101);
+    }
+#endif
+    acc = (guint8) carry;
+    for (; i < len; i++) {
+        acc ^= data[i];
+        px[i + 1] = acc;
+    }
+}
+
+static void count_frame(chunk_t *c, const guint8 *frame, gsize offset, guint size)
+{
+    frame_index_t entry = { offset, size };
+
+    c->frames++;
+    c->dev_frames[frame[IKBUS_FRM_SENDER]]++;
+    c->dev_bytes[frame[IKBUS_FRM_SENDER]] += size;
+    c->cmd_frames[frame[IKBUS_FRM_SENDER]][frame[IKBUS_FRM_CMD]]++;
+
+    if (c->nheads < HEADS_MAX)
+        c->heads[c->nheads++] = entry;
+    if (c->index != NULL)
+        g_array_append_val(c->index, entry);
+}
+
+static void uncount_frame(chunk_t *c, const guint8 *frame, guint size)
+{
+    c->frames--;
+    c->dev_frames[frame[IKBUS_FRM_SENDER]]--;
+    c->dev_bytes[frame[IKBUS_FRM_SENDER]] -= size;
+    c->cmd_frames[frame[IKBUS_FRM_SENDER]][frame[IKBUS_FRM_CMD]]--;
+}
+
+/* Size of the frame at offset, 0 if none starts there */
+static guint frame_at(const guint8 *data, gsize length, gsize offset)
+{
+    guint size, i;
+    guint8 xor = 0;
+
+    if (offset + IKBUS_SYNC_MIN_FRAME > length)
+        return 0;
+    size = data[offset + IKBUS_FRM_SIZE] + 2;
+    if ((size < IKBUS_SYNC_MIN_FRAME) || (size > IKBUS_MAX_FRAME_SIZE) || (offset + size > length))
+        return 0;
+    for (i = 0; i < size; i++)
+        xor ^= data[offset + i];
+    return (xor == 0) ? size : 0;
+}
+
+/* Scan from offset for frames starting before end, returns where the scan stopped */
+static gsize scan_range(chunk_t *c, gsize pos, gsize end)
+{
+    guint8 *px = g_malloc(BLOCK_SIZE + IKBUS_MAX_FRAME_SIZE + 1);
+    gsize block_end, avail, o;
+    guint size;
+
+    while (pos < end) {
+        block_end = MIN(pos + BLOCK_SIZE, end);
+        avail = MIN(block_end + IKBUS_MAX_FRAME_SIZE, c->length) - pos;
+        prefix_xor(c->data + pos, avail, px);
+
+        for (o = 0; pos + o < block_end; ) {
+            if (o + IKBUS_SYNC_MIN_FRAME > avail)
+                break;
+            size = c->data[pos + o + IKBUS_FRM_SIZE] + 2;
+            if ((size >= IKBUS_SYNC_MIN_FRAME) && (size <= IKBUS_MAX_FRAME_SIZE) &&
+                (o + size <= avail) && (px[o] == px[o + size])) {
+                count_frame(c, c->data + pos + o, pos + o, size);
+                o += size;
+            }
+            else {
+                c->discarded++;
+                o++;
+            }
+        }
+
+        /* Tail of the dump too short for a frame */
+        if (pos + o < block_end) {
+            c->discarded += block_end - (pos + o);
+            o = block_end - pos;
+        }
+        pos += o;
+    }
+
+    g_free(px);
+    return pos;
+}
+
+static gpointer scan_chunk(gpointer data)
+{
+    chunk_t *c = data;
+
+    c->next = scan_range(c, c->start, c->end);
+    return NULL;
+}
+
+/* Drop everything a chunk found and scan it again from offset */
+static void rescan_chunk(chunk_t *c, gsize offset)
+{
+    c->frames = 0;
+    c->discarded = 0;
+    memset(c->dev_frames, 0, sizeof(c->dev_frames));
+    memset(c->dev_bytes, 0, sizeof(c->dev_bytes));
+    memset(c->cmd_frames, 0, sizeof(guint64) * 256 * 256);
+    c->nheads = 0;
+    if (c->index != NULL)
+        g_array_set_size(c->index, 0);
+
+    c->next = scan_range(c, offset, MAX(offset, c->end));
+}
+
+/*
+ * Carry the scan on from where the previous chunk left off, counting into
+ * the previous chunk, until it reaches an offset the scan of this chunk
+ * stopped at too: the start of one of its frames or a skipped byte. The
+ * frames and bytes of this chunk before that offset are dropped. If the
+ * first frames of the chunk are not enough to tell, the chunk is scanned
+ * again.
+ */
+static void join_chunk(chunk_t *prev, chunk_t *c)
+{
+    gsize p = prev->next, bytes = 0;
+    guint h = 0, j, size;
+
+    for (;;) {
+        while ((h < c->nheads) && (c->heads[h].offset + c->heads[h].size <= p))
+            h++;
+
+        if (h < c->nheads) {
+            if (c->heads[h].offset >= p)
+                break;
+        }
+        else if ((c->nheads == HEADS_MAX) || (p >= c->end)) {
+            rescan_chunk(c, p);
+            return;
+        }
+        else {
+            break;
+        }
+
+        /* Inside a frame of this chunk, the previous chunk decides */
+        size = frame_at(c->data, c->length, p);
+        if (size > 0) {
+            count_frame(prev, c->data + p, p, size);
+            p += size;
+        }
+        else {
+            prev->discarded++;
+            p++;
+        }
+    }
+
+    for (j = 0; j < h; j++) {
+        uncount_frame(c, c->data + c->heads[j].offset, c->heads[j].size);
+        bytes += c->heads[j].size;
+    }
+    c->discarded -= (p - c->start) - bytes;
+    c->first = p;
+}
+
+static void write_index(chunk_t *chunks, guint n, const guint8 *dump, FILE *out)
+{
+    const frame_index_t *e;
+    const guint8 *f;
+    guint i, j;
+
+    fprintf(out, "# offset\tsize\tsender\treceiver\tcommand\n");
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < chunks[i].index->len; j++) {
+            e = &g_array_index(chunks[i].index, frame_index_t, j);
+            if (e->offset < chunks[i].first)
+                continue;
+            f = dump + e->offset;
+            fprintf(out, "%" G_GUINT64_FORMAT "\t%u\t%02X\t%02X\t%02X\n", e->offset, e->size,
+                    f[IKBUS_FRM_SENDER], f[IKBUS_FRM_RECEIVER], f[IKBUS_FRM_CMD]);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    GMappedFile *file;
+    GThread **workers;
+    chunk_t *chunks, total;
+    const guint8 *dump;
+    gsize length, step;
+    gint64 start, elapsed;
+    guint i, j, n;
+    FILE *out;
+
+    context = g_option_context_new("DUMP - frame statistics of a raw I/K-bus byte dump");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return -1;
+    }
+    g_option_context_free(context);
+
+    if (argc != 2) {
+        g_printerr("Usage: %s [OPTION...] DUMP\n", argv[0]);
+        return -1;
+    }
+
+    file = g_mapped_file_new(argv[1], FALSE, &error);
+    if (file == NULL) {
+        g_printerr("%s\n", error->message);
+        return -1;
+    }
+    dump = (const guint8 *) g_mapped_file_get_contents(file);
+    length = g_mapped_file_get_length(file);
+
+    /* No point in chunks shorter than a block */
+    n = (threads > 0) ? (guint) threads : g_get_num_processors();
+    n = CLAMP(n, 1, MAX(length / BLOCK_SIZE, 1));
+    step = length / n;
+
+    start = g_get_monotonic_time();
+    chunks = g_new0(chunk_t, n);
+    workers = g_new0(GThread *, n);
+    for (i = 0; i < n; i++) {
+        chunks[i].data = dump;
+        chunks[i].length = length;
+        chunks[i].start = i * step;
+        chunks[i].end = (i == n - 1) ? length : (i + 1) * step;
+        chunks[i].cmd_frames = g_malloc0(sizeof(guint64) * 256 * 256);
+        if (index_file != NULL)
+            chunks[i].index = g_array_new(FALSE, FALSE, sizeof(frame_index_t));
+        workers[i] = g_thread_new("analyze", scan_chunk, &chunks[i]);
+    }
+
+    /* Join the chunks in order, then merge */
+    memset(&total, 0, sizeof(total));
+    total.cmd_frames = g_malloc0(sizeof(guint64) * 256 * 256);
+    for (i = 0; i < n; i++) {
+        g_thread_join(workers[i]);
+        if (i > 0)
+            join_chunk(&chunks[i - 1], &chunks[i]);
+    }
+    for (i = 0; i < n; i++) {
+        total.frames += chunks[i].frames;
+        total.discarded += chunks[i].discarded;
+        for (j = 0; j < 256; j++) {
+            total.dev_frames[j] += chunks[i].dev_frames[j];
+            total.dev_bytes[j] += chunks[i].dev_bytes[j];
+        }
+        for (j = 0; j < 256 * 256; j++)
+            total.cmd_frames[j / 256][j % 256] += chunks[i].cmd_frames[j / 256][j % 256];
+    }
+    elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    g_print("%" G_GUINT64_FORMAT " frames, %" G_GUINT64_FORMAT " of %" G_GSIZE_FORMAT
+            " bytes skipped as noise, %u threads, %.1f MB/s\n",
+            total.frames, total.discarded, length, n, (gdouble) length / elapsed);
+
+    g_print("\nSender      frames       bytes\n");
+    for (i = 0; i < 256; i++)
+        if (total.dev_frames[i] > 0)
+            g_print("%02X %-4s %10" G_GUINT64_FORMAT " %11" G_GUINT64_FORMAT "\n", i,
+                    device_name(i), total.dev_frames[i], total.dev_bytes[i]);
+
+    g_print("\nSender Command     frames\n");
+    for (i = 0; i < 256; i++)
+        for (j = 0; j < 256; j++)
+            if (total.cmd_frames[i][j] > 0)
+                g_print("%02X %-4s %02X %14" G_GUINT64_FORMAT "\n", i, device_name(i), j,
+                        total.cmd_frames[i][j]);
+
+    if (index_file != NULL) {
+        out = fopen(index_file, "w");
+        if (out == NULL) {
+            g_printerr("%s: %s\n", index_file, g_strerror(errno));
+            return -1;
+        }
+        write_index(chunks, n, dump, out);
+        fclose(out);
+    }
+
+    for (i = 0; i < n; i++) {
+        g_free(chunks[i].cmd_frames);
+        if (chunks[i].index != NULL)
+            g_array_free(chunks[i].index, TRUE);
+    }
+    g_free(total.cmd_frames);
+    g_free(chunks);
+    g_free(workers);
+    g_mapped_file_unref(file);
+
+    return 0;
+}
@@ -18,10 +18,16 @@
  */
 
 #include <gio/gio.h>
+#include <string.h>
+#include <errno.h>
 #include "ikbussocket.h"
+#include "ikbusmux.h"
 #include "ikbuscdc.h"
 
-#define CDC_BUF_SIZE 64
+#define CDC_MID_BUTTON_HOLD 150 /* ms between button press and release */
+#define CDC_STAT_SIZE 11        /* CD status frame without checksum */
+#define CDC_ANNOUNCE_MAX 3600   /* s, upper bound of "announce-interval" */
+
 const guint8 CDC_I_AM_HERE[] = 
         {IKBUS_DEV_CDC, 0x04, IKBUS_DEV_LOC, IKBUS_MSG_DEV_STAT_READY, 0x00};
 
@@ -41,27 +47,56 @@ const char CDC_IDENTY[] = {
   0x01  /* Software version*/
 };
 
+typedef struct
+{
+  IKBusCdcMessageFunc func;
+  gpointer user_data;
+} IKBusCdcMessage;
+
 struct _IKBusCdcPrivate
 {
   gchar *ifname;
+  gboolean io_thread;             /* Socket I/O thread answers status polls */
+  guint tx_gap;                   /* us, passed to an own socket, a mux has its own */
   GIOChannel *channel;
   IKBusSocket *iksock;
+  IKBusMux *mux;                  /* Shared socket, NULL if the changer has its own */
+  gint mux_client;
   gint real_tracknum;
 
-  guint8 *stat_resp;              /* Response status to controlling device */
-  guint8 *ack_resp;               /* Response acknowledge to controlling device */
+  guint8 ctrl_arg;                /* Additional parameters of the last playback command */
+
+  /* CD status reported to the controlling device */
+  guint8 stat_resp;               /* Response status to controlling device */
+  guint8 ack_resp;                /* Response acknowledge to controlling device */
+  guint8 error_mask;
+  guint8 cd_mask;                 /* Mask of presence of discs in the changer */
+  guint8 cdnum;                   /* Current disc */
+  guint8 tracknum;                /* Current track */
 
-  guint8 *tracknum;               /* Current track */
-  guint8 *cdnum;                  /* Current disc */
-  guint8 *error_mask;
-  guint8 *cd_mask;                /* Mask of presence of discs in the changer */
-  guint8 *ctrl_task;              /* Command to playback */
-  guint8 *ctrl_arg;               /* Additional parameters to playback */
+  /* Virtual magazine, shown to the radio one page of six discs at a time */
+  guint64 disc_mask;              /* Bit n set if disc n + 1 is present */
+  guint vdisc;                    /* Current disc in the virtual magazine */
+
+  /* Announce is due after this many seconds without any frame sent */
+  guint head_unit;
+  guint announce_interval;        /* s, 0 to use the head unit default */
+  guint announce_id;
+  gint64 tx_last;                 /* Monotonic time of the changer's own last frame, us */
 
 /* Buffers for I/K-bus messages */
-  guint8 rx_buf[CDC_BUF_SIZE];    /* Raw data from I/K-bus */
-  guint8 tx_buf[CDC_BUF_SIZE];    /* Data ready to be written to I/K-bus */
-  guint8 *msg_cmd;                /* I/K-bus command type message */
+  IKBusSocketFrame rx_frames[IKBUS_SOCKET_BATCH_SIZE]; /* Raw data from I/K-bus */
+  IKBusFrame rx_views[IKBUS_SOCKET_BATCH_SIZE];
+
+  IKBusCdcMessage messages[256];  /* Handlers by I/K-bus message type */
+
+  guint8 stat_frame[CDC_STAT_SIZE]; /* Status frame of the current state */
+  gboolean stat_valid;            /* Cleared by every change of the status bytes */
+  guint req_status_id;            /* Pending "req-status" emission */
+
+  guint64 cache_hits;
+  guint64 cache_misses;
+  guint64 drops[IKBUS_CDC_DROP_LAST];
 };
 
 static void 
@@ -74,11 +109,23 @@ enum
 {
   PROP_0,
   PROP_IFNAME,
+  PROP_IO_THREAD,
+  PROP_HEAD_UNIT,
+  PROP_ANNOUNCE_INTERVAL,
+  PROP_MUX,
+  PROP_TX_GAP,
   N_PROP
 };
 
 static GParamSpec *obj_properties[N_PROP] = { NULL, };
 
+/* Default announce interval by IKBusCdcHeadUnit, ms */
+static const guint cdc_announce_intervals[IKBUS_CDC_HEAD_UNIT_LAST] = {
+  [IKBUS_CDC_HEAD_UNIT_GENERIC] = 3800,
+  [IKBUS_CDC_HEAD_UNIT_BUSINESS] = 20000,
+  [IKBUS_CDC_HEAD_UNIT_NAVIGATION] = 30000,
+};
+
 enum {
   REQ_STATUS,
   STOP,
@@ -105,7 +152,8 @@ ikbus_cdc_finalize (GObject *object)
   IKBusCdc *g_cdc= IKBUS_CDC (object);
 
   g_free (g_cdc->priv->ifname);
-  g_io_channel_shutdown (g_cdc->priv->channel, FALSE, NULL);
+  if (g_cdc->priv->channel != NULL)
+    g_io_channel_shutdown (g_cdc->priv->channel, FALSE, NULL);
   G_OBJECT_CLASS (ikbus_cdc_parent_class)->finalize (object);
 }
 
@@ -114,6 +162,31 @@ ikbus_cdc_dispose (GObject *object)
 {
   IKBusCdc *g_cdc= IKBUS_CDC (object);
 
+  if (g_cdc->priv->announce_id != 0)
+  {
+    g_source_remove (g_cdc->priv->announce_id);
+    g_cdc->priv->announce_id = 0;
+  }
+  if (g_cdc->priv->req_status_id != 0)
+  {
+    g_source_remove (g_cdc->priv->req_status_id);
+    g_cdc->priv->req_status_id = 0;
+  }
+  if (g_cdc->priv->mux != NULL)
+  {
+    if (g_cdc->priv->mux_client >= 0)
+      ikbus_mux_remove_client (g_cdc->priv->mux, g_cdc->priv->mux_client);
+    g_cdc->priv->mux_client = -1;
+    g_clear_object (&g_cdc->priv->mux);
+  }
+  /* A shared socket outlives the changer, its replies must not */
+  if (g_cdc->priv->io_thread && (g_cdc->priv->iksock != NULL))
+  {
+    ikbus_socket_clear_auto_reply (g_cdc->priv->iksock, IKBUS_DEV_CDC,
+                                   IKBUS_MSG_DEV_STAT_REQ, IKBUS_SOCKET_ANY_SUB);
+    ikbus_socket_clear_auto_reply (g_cdc->priv->iksock, IKBUS_DEV_CDC,
+                                   IKBUS_MSG_CD_CTL, CDC_CMD_STAT_REQ);
+  }
   g_clear_object (&g_cdc->priv->iksock);
   G_OBJECT_CLASS (ikbus_cdc_parent_class)->dispose (object);
 }
@@ -131,6 +204,21 @@ ikbus_cdc_get_property (GObject *object,
       case PROP_IFNAME:
         g_value_set_string (value, g_cdc->priv->ifname);
         break;
+      case PROP_IO_THREAD:
+        g_value_set_boolean (value, g_cdc->priv->io_thread);
+        break;
+      case PROP_HEAD_UNIT:
+        g_value_set_uint (value, g_cdc->priv->head_unit);
+        break;
+      case PROP_ANNOUNCE_INTERVAL:
+        g_value_set_uint (value, g_cdc->priv->announce_interval);
+        break;
+      case PROP_MUX:
+        g_value_set_object (value, g_cdc->priv->mux);
+        break;
+      case PROP_TX_GAP:
+        g_value_set_uint (value, g_cdc->priv->tx_gap);
+        break;
 
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -151,121 +239,298 @@ ikbus_cdc_set_property (GObject *object,
         if (g_cdc->priv->ifname == NULL)
           g_cdc->priv->ifname = g_strdup (g_value_get_string (value));
         break;
+      case PROP_IO_THREAD:
+        g_cdc->priv->io_thread = g_value_get_boolean (value);
+        break;
+      case PROP_HEAD_UNIT:
+        g_cdc->priv->head_unit = g_value_get_uint (value);
+        break;
+      case PROP_ANNOUNCE_INTERVAL:
+        g_cdc->priv->announce_interval = g_value_get_uint (value);
+        break;
+      case PROP_MUX:
+        g_cdc->priv->mux = g_value_dup_object (value);
+        break;
+      case PROP_TX_GAP:
+        g_cdc->priv->tx_gap = g_value_get_uint (value);
+        break;
 
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
 }
 
+/* Flags of the CD control command table */
+#define CMD_VALID       (1 << 0)
+#define CMD_SEND        (1 << 1)  /* Reply with CD status after the signal */
+#define CMD_REPLY_FIRST (1 << 2)  /* Reply with CD status before the signal */
+#define CMD_ARG_SELECT  (1 << 3)  /* Nonzero argument selects variant 1 */
+#define CMD_ARG_SWITCH  (1 << 4)  /* Argument 1 selects variant 1 and sets ack_bits */
+
+#define CMD_KEEP        (-1)      /* Leave status/acknowledge as is */
+#define CDC_CMD_COUNT   16
+
+typedef struct
+{
+  guint8 flags;
+  guint8 signal[2];               /* Signal to emit, by variant */
+  gint16 stat[2];                 /* Response status, by variant */
+  gint16 ack;                     /* Response acknowledge */
+  guint8 ack_bits;                /* Acknowledge bits switched by CMD_ARG_SWITCH */
+} IKBusCdcCommand;
+
+static const IKBusCdcCommand cdc_commands[CDC_CMD_COUNT] = {
+  [CDC_CMD_STAT_REQ] = { CMD_VALID | CMD_REPLY_FIRST,
+                         { REQ_STATUS, REQ_STATUS }, { CMD_KEEP, CMD_KEEP }, CMD_KEEP, 0 },
+  [CDC_CMD_STOP]     = { CMD_VALID | CMD_SEND,
+                         { STOP, STOP }, { CDC_STAT_STOP, CDC_STAT_STOP }, CDC_ACK_PAUSE, 0 },
+  [CDC_CMD_PAUSE]    = { CMD_VALID | CMD_SEND,
+                         { PAUSE, PAUSE }, { CDC_STAT_NO_MAGAZINE, CDC_STAT_NO_MAGAZINE }, CDC_ACK_PAUSE, 0 },
+  [CDC_CMD_PLAY]     = { CMD_VALID | CMD_SEND,
+                         { PLAY, PLAY }, { CDC_STAT_PLAY, CDC_STAT_PLAY }, CDC_ACK_PLAY, 0 },
+  [CDC_CMD_FAST]     = { CMD_VALID | CMD_SEND | CMD_ARG_SELECT,
+                         { REWIND, FAST }, { CDC_STAT_REWIND, CDC_STAT_FAST_FOR }, CDC_ACK_PLAY, 0 },
+  [CDC_CMD_CHNG_TR]  = { CMD_VALID | CMD_ARG_SELECT,
+                         { NEXT, PREVIOUS }, { CMD_KEEP, CMD_KEEP }, CMD_KEEP, 0 },
+  [CDC_CMD_CHNG_CD]  = { CMD_VALID,
+                         { DISC, DISC }, { CMD_KEEP, CMD_KEEP }, CMD_KEEP, 0 },
+  [CDC_CMD_SC]       = { CMD_VALID | CMD_SEND | CMD_ARG_SWITCH,
+                         { SCAN_OFF, SCAN_ON }, { CMD_KEEP, CMD_KEEP }, CMD_KEEP, CDC_ACK_SC },
+  [CDC_CMD_RANDOM]   = { CMD_VALID | CMD_SEND | CMD_ARG_SWITCH,
+                         { RANDOM_OFF, RANDOM_ON }, { CMD_KEEP, CMD_KEEP }, CMD_KEEP, CDC_ACK_RND },
+  [CDC_CMD_CHNG_TRK] = { CMD_VALID | CMD_ARG_SELECT,
+                         { NEXT, PREVIOUS }, { CMD_KEEP, CMD_KEEP }, CMD_KEEP, 0 },
+};
+
+/*
+ * CD status frame for the current state. The frame is built once after a
+ * change of the status bytes and sent as is until the next change.
+ */
+static const guint8 *
+ikbus_cdc_status_frame (IKBusCdc *cdc)
+{
+  IKBusCdcPrivate *priv = cdc->priv;
+  guint8 *frame = priv->stat_frame;
+
+  if (priv->stat_valid)
+  {
+    priv->cache_hits++;
+  }
+  else
+  {
+    priv->stat_valid = TRUE;
+    priv->cache_misses++;
+    frame[IKBUS_FRM_SENDER] = IKBUS_DEV_CDC;
+    frame[IKBUS_FRM_SIZE] = CDC_STAT_SIZE - 1;
+    frame[IKBUS_FRM_RECEIVER] = IKBUS_DEV_RAD;
+    frame[IKBUS_FRM_CMD] = IKBUS_MSG_CD_STAT;
+    frame[4] = priv->stat_resp;
+    frame[5] = priv->ack_resp;
+    frame[6] = priv->error_mask;
+    frame[7] = priv->cd_mask;
+    frame[8] = 0;
+    frame[9] = priv->cdnum;
+    frame[10] = priv->tracknum;
+  }
+
+  return frame;
+}
+
+/*
+ * Frames the changer sends as itself. A shared socket also carries the
+ * frames of other devices, so the announce goes by these alone.
+ */
 static void
-ikbus_action (IKBusCdc *cdc)
+ikbus_cdc_send (IKBusCdc *cdc, const guint8 *buf, gint nbytes, IKBusSocketPriority prio)
 {
-  switch (*cdc->priv->msg_cmd)
-    {
-    /* Response to status request */
-    case IKBUS_MSG_DEV_STAT_REQ:
-      ikbus_socket_write (cdc->priv->iksock, CDC_I_AM_HERE, 5);
-      break;
+  cdc->priv->tx_last = g_get_monotonic_time ();
+  ikbus_socket_write_full (cdc->priv->iksock, buf, nbytes, prio, 0);
+}
 
-    /* Control playback */
-    case IKBUS_MSG_CD_CTL:
+/* Send the CD status frame */
+static void
+ikbus_cdc_send_status (IKBusCdc *cdc, IKBusSocketPriority prio)
+{
+  ikbus_cdc_send (cdc, ikbus_cdc_status_frame (cdc), CDC_STAT_SIZE, prio);
+}
 
-      switch (*cdc->priv->ctrl_task) 
-        {
+/*
+ * Called after every change of the status bytes. Drops the prebuilt status
+ * frame and keeps the status the I/O thread replies with in step with the
+ * changer state.
+ */
+static void
+ikbus_cdc_status_changed (IKBusCdc *cdc)
+{
+  cdc->priv->stat_valid = FALSE;
+  if (!cdc->priv->io_thread || (cdc->priv->iksock == NULL))
+    return;
 
-        case CDC_CMD_STAT_REQ:
-          ikbus_cdc_sync_output (cdc, NULL);
-          g_signal_emit (cdc, signals[REQ_STATUS], 0);
-          break;
+  ikbus_socket_set_auto_reply (cdc->priv->iksock, IKBUS_MSG_CD_CTL, CDC_CMD_STAT_REQ,
+                               ikbus_cdc_status_frame (cdc), CDC_STAT_SIZE);
+}
 
-        case CDC_CMD_STOP:
-          g_signal_emit (cdc, signals[STOP], 0);
-          *cdc->priv->stat_resp = CDC_STAT_STOP;
-          *cdc->priv->ack_resp = CDC_ACK_PAUSE;
-          ikbus_socket_write (cdc->priv->iksock, cdc->priv->tx_buf, 11);
-          break;
+static gboolean
+ikbus_cdc_emit_req_status (gpointer data)
+{
+  IKBusCdc *cdc = IKBUS_CDC (data);
 
-        case CDC_CMD_PAUSE:
-          g_signal_emit (cdc, signals[PAUSE], 0);
-          *cdc->priv->stat_resp = CDC_STAT_NO_MAGAZINE;
-          *cdc->priv->ack_resp = CDC_ACK_PAUSE;
-          ikbus_socket_write (cdc->priv->iksock, cdc->priv->tx_buf, 11);
-          break;
+  cdc->priv->req_status_id = 0;
+  g_signal_emit (cdc, signals[REQ_STATUS], 0);
+  return G_SOURCE_REMOVE;
+}
 
-        case CDC_CMD_PLAY:
-          g_signal_emit (cdc, signals[PLAY], 0);
-          *cdc->priv->stat_resp = CDC_STAT_PLAY;
-          *cdc->priv->ack_resp = CDC_ACK_PLAY;
-          ikbus_socket_write (cdc->priv->iksock, cdc->priv->tx_buf, 11);
-          break;
+static void
+ikbus_cdc_msg_stat_req (IKBusCdc *cdc,
+                        const IKBusFrame *frame,
+                        G_GNUC_UNUSED gpointer user_data)
+{
+  if (frame->flags & IKBUS_SOCKET_FRAME_ANSWERED)
+    return;
+  ikbus_cdc_send (cdc, CDC_I_AM_HERE, 5, IKBUS_SOCKET_PRIO_POLL_REPLY);
+}
 
-        case CDC_CMD_FAST:
-          if (*cdc->priv->ctrl_arg == 0) {
-            g_signal_emit (cdc, signals[REWIND], 0, *cdc->priv->ctrl_arg);
-            *cdc->priv->stat_resp = CDC_STAT_REWIND;
-          }
-          else {
-            g_signal_emit (cdc, signals[FAST], 0, *cdc->priv->ctrl_arg);
-            *cdc->priv->stat_resp = CDC_STAT_FAST_FOR;
-          }
-          *cdc->priv->ack_resp = CDC_ACK_PLAY;
-          ikbus_socket_write (cdc->priv->iksock, cdc->priv->tx_buf, 11);
-          break;
+static void
+ikbus_cdc_msg_ident (IKBusCdc *cdc,
+                     G_GNUC_UNUSED const IKBusFrame *frame,
+                     G_GNUC_UNUSED gpointer user_data)
+{
+  ikbus_cdc_send (cdc, CDC_IDENTY, 16, IKBUS_SOCKET_PRIO_POLL_REPLY);
+}
 
-        case CDC_CMD_CHNG_TR:
-        case CDC_CMD_CHNG_TRK:
-          if (*cdc->priv->ctrl_arg == 0)
-            g_signal_emit (cdc, signals[NEXT], 0);
-          else
-            g_signal_emit (cdc, signals[PREVIOUS], 0);
-          break;
+/* Control playback */
+static void
+ikbus_cdc_msg_cd_ctl (IKBusCdc *cdc,
+                      const IKBusFrame *frame,
+                      G_GNUC_UNUSED gpointer user_data)
+{
+  const IKBusCdcCommand *cmd;
+  guint8 task, arg;
+  guint variant = 0;
 
-        case CDC_CMD_CHNG_CD:
-          g_signal_emit (cdc, signals[DISC], 0);
-          break;
+  if (frame->payload_len < 2)
+  {
+    cdc->priv->drops[IKBUS_CDC_DROP_BAD_LENGTH]++;
+    return;
+  }
 
-        case CDC_CMD_SC:
-          if (*cdc->priv->ctrl_arg == 1)
-          {
-            *cdc->priv->ack_resp |= CDC_ACK_SC;
-            g_signal_emit (cdc, signals[SCAN_ON], 0);
-          }
-          else
-          {
-            *cdc->priv->ack_resp &= ~CDC_ACK_SC;
-            g_signal_emit (cdc, signals[SCAN_OFF], 0);
-          }
-          ikbus_socket_write (cdc->priv->iksock, cdc->priv->tx_buf, 11);
-          break;
+  task = frame->payload[0];
+  arg = frame->payload[1];
+  cdc->priv->ctrl_arg = arg;
 
-        case CDC_CMD_RANDOM:
-          if (*cdc->priv->ctrl_arg == 1)
-          {
-            *cdc->priv->ack_resp |= CDC_ACK_RND;
-            g_signal_emit (cdc, signals[RANDOM_ON], 0);
-          }
-          else
-          {
-            *cdc->priv->ack_resp &= ~CDC_ACK_RND;
-            g_signal_emit (cdc, signals[RANDOM_OFF], 0);
-          }
-          ikbus_socket_write (cdc->priv->iksock, cdc->priv->tx_buf, 11);
-          break;
+  cmd = (task < CDC_CMD_COUNT) ? &cdc_commands[task] : NULL;
+  if ((cmd == NULL) || !(cmd->flags & CMD_VALID))
+  {
+    cdc->priv->drops[IKBUS_CDC_DROP_COMMAND]++;
+    g_debug ("Unknown CDC command 0x%02X\n", task);
+    return;
+  }
 
-        default:
-          g_warning ("Unknown CDC command 0x%02X\n", *cdc->priv->ctrl_task);
-        }
-      break;
+  if (cmd->flags & CMD_ARG_SELECT)
+    variant = (arg != 0);
+  else if (cmd->flags & CMD_ARG_SWITCH)
+    variant = (arg == 1);
 
-    /* Identity request */
-    case IKBUS_DIA_READ_IDENT:
-      ikbus_socket_write (cdc->priv->iksock, CDC_IDENTY, 16);
-      break;
+  if ((cmd->flags & CMD_REPLY_FIRST) && !(frame->flags & IKBUS_SOCKET_FRAME_ANSWERED))
+    ikbus_cdc_send_status (cdc, IKBUS_SOCKET_PRIO_POLL_REPLY);
 
+  g_signal_emit (cdc, signals[cmd->signal[variant]], 0, arg);
 
-    default:
-      g_warning ("Unknown CDC message 0x%02X\n", *cdc->priv->msg_cmd);
-    }
+  if (cmd->stat[variant] != CMD_KEEP)
+    cdc->priv->stat_resp = (guint8) cmd->stat[variant];
+  if (cmd->ack != CMD_KEEP)
+    cdc->priv->ack_resp = (guint8) cmd->ack;
+  if (cmd->flags & CMD_ARG_SWITCH)
+  {
+    if (variant)
+      cdc->priv->ack_resp |= cmd->ack_bits;
+    else
+      cdc->priv->ack_resp &= ~cmd->ack_bits;
+  }
+
+  ikbus_cdc_status_changed (cdc);
+  if (cmd->flags & CMD_SEND)
+    ikbus_cdc_send_status (cdc, IKBUS_SOCKET_PRIO_POLL_REPLY);
+}
+
+/*
+ * Status polls are most of the traffic and have the tightest deadline.
+ * Answer them from the prebuilt status frame without going through signals;
+ * "req-status" follows from an idle callback, once per burst of polls.
+ * Handlers replaced with ikbus_cdc_register_message() take the slow path.
+ */
+static gboolean
+ikbus_cdc_fast_reply (IKBusCdc *cdc, const IKBusFrame *frame, const IKBusCdcMessage *msg)
+{
+  IKBusCdcPrivate *priv = cdc->priv;
+  gboolean answered = frame->flags & IKBUS_SOCKET_FRAME_ANSWERED;
+
+  if ((frame->cmd == IKBUS_MSG_DEV_STAT_REQ) && (msg->func == ikbus_cdc_msg_stat_req))
+  {
+    if (!answered)
+      ikbus_cdc_send (cdc, CDC_I_AM_HERE, 5, IKBUS_SOCKET_PRIO_POLL_REPLY);
+    return TRUE;
+  }
+
+  if ((frame->cmd != IKBUS_MSG_CD_CTL) || (msg->func != ikbus_cdc_msg_cd_ctl) ||
+      (frame->payload_len < 2) || (frame->payload[0] != CDC_CMD_STAT_REQ))
+    return FALSE;
+
+  priv->ctrl_arg = frame->payload[1];
+  if (!answered)
+    ikbus_cdc_send (cdc, ikbus_cdc_status_frame (cdc), CDC_STAT_SIZE,
+                    IKBUS_SOCKET_PRIO_POLL_REPLY);
+
+  if (priv->req_status_id == 0)
+    priv->req_status_id = g_idle_add (ikbus_cdc_emit_req_status, cdc);
+
+  return TRUE;
+}
+
+static void
+ikbus_action (IKBusCdc *cdc, const IKBusFrame *frame)
+{
+  const IKBusCdcMessage *msg;
+
+  /* Frames for the changer itself or broadcasts */
+  if ((frame->receiver != IKBUS_DEV_CDC) && (frame->receiver != IKBUS_DEV_LOC) &&
+      (frame->receiver != IKBUS_DEV_GLO))
+  {
+    cdc->priv->drops[IKBUS_CDC_DROP_RECEIVER]++;
+    return;
+  }
+
+  /* The I/O thread answered a poll of the changer on its behalf */
+  if ((frame->flags & IKBUS_SOCKET_FRAME_ANSWERED) && (frame->receiver == IKBUS_DEV_CDC))
+    cdc->priv->tx_last = g_get_monotonic_time ();
+
+  msg = &cdc->priv->messages[frame->cmd];
+  if (ikbus_cdc_fast_reply (cdc, frame, msg))
+    return;
+
+  if (msg->func == NULL)
+  {
+    cdc->priv->drops[IKBUS_CDC_DROP_MESSAGE]++;
+    g_debug ("Unknown CDC message 0x%02X\n", frame->cmd);
+    return;
+  }
+
+  msg->func (cdc, frame, msg->user_data);
+}
+
+/**
+ * ikbus_cdc_register_message:
+ * Handle I/K-bus messages of type msg with func. Replaces the built-in
+ * handler, a NULL func drops the message type.
+ */
+void
+ikbus_cdc_register_message (IKBusCdc *cdc, guint8 msg,
+                            IKBusCdcMessageFunc func, gpointer user_data)
+{
+  g_return_if_fail (IKBUS_IS_CDC (cdc));
+
+  cdc->priv->messages[msg].func = func;
+  cdc->priv->messages[msg].user_data = user_data;
 }
 
 static gboolean
@@ -274,48 +539,151 @@ ikbus_cdc_receiving (G_GNUC_UNUSED GIOChannel *source,
                     gpointer data)
 {
   IKBusCdc *cdc = IKBUS_CDC (data);
-  gint n;
+  IKBusSocketFrame *raw;
+  GError *error = NULL;
+  gint i, n, nviews = 0;
 
-  n = ikbus_socket_read (cdc->priv->iksock, cdc->priv->rx_buf);
-  if ((n > 4) && (n < 8))
-        ikbus_action (cdc);
+  n = ikbus_socket_read_batch (cdc->priv->iksock, cdc->priv->rx_frames,
+                               IKBUS_SOCKET_BATCH_SIZE);
+  if (n < 0)
+    {
+      /* Hung up or failed, the socket would stay readable */
+      g_warning ("CDC: stopped reading the bus: %s\n", g_strerror (errno));
+      /* The watch held the last reference to the channel */
+      cdc->priv->channel = NULL;
+      return FALSE;
+    }
+  for (i = 0; i < n; i++)
+    {
+      raw = &cdc->priv->rx_frames[i];
+      switch (ikbus_frame_parse (&cdc->priv->rx_views[nviews], raw->data, raw->nbytes))
+        {
+        case IKBUS_FRAME_OK:
+          cdc->priv->rx_views[nviews++].flags = raw->flags;
+          break;
+        case IKBUS_FRAME_TOO_SHORT:
+          cdc->priv->drops[IKBUS_CDC_DROP_TOO_SHORT]++;
+          break;
+        case IKBUS_FRAME_BAD_LENGTH:
+          cdc->priv->drops[IKBUS_CDC_DROP_BAD_LENGTH]++;
+          break;
+        case IKBUS_FRAME_BAD_CHECKSUM:
+          cdc->priv->drops[IKBUS_CDC_DROP_BAD_CHECKSUM]++;
+          break;
+        }
+    }
+
+  /* Replies of this dispatch cycle leave with one flush */
+  ikbus_socket_tx_begin (cdc->priv->iksock);
+  for (i = 0; i < nviews; i++)
+    ikbus_action (cdc, &cdc->priv->rx_views[i]);
+  if (!ikbus_socket_tx_end (cdc->priv->iksock, &error))
+    {
+      g_warning ("CDC: %s\n", error->message);
+      g_clear_error (&error);
+    }
 
   return TRUE;
 }
 
+/* Frame routed by the shared socket, replies are flushed by the mux */
+static void
+ikbus_cdc_mux_receive (const IKBusFrame *frame, gpointer data)
+{
+  ikbus_action (IKBUS_CDC (data), frame);
+}
+
+/* Take frames for the changer and broadcasts from the shared socket */
 static gboolean
-ikbus_cdc_timeout (gpointer data)
+ikbus_cdc_mux_attach (IKBusCdc *cdc, GError **error)
 {
-  IKBusCdc *cdc = IKBUS_CDC (data);
+  IKBusCdcPrivate *priv = cdc->priv;
+
+  /* Pacing is a property of the socket, it would be silently ignored here */
+  if (priv->tx_gap != 0)
+  {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                         "tx-gap of a changer on a shared socket is set on the mux");
+    return FALSE;
+  }
+
+  priv->iksock = g_object_ref (ikbus_mux_get_socket (priv->mux));
+  g_object_get (priv->iksock, "io-thread", &priv->io_thread, NULL);
+
+  priv->mux_client = ikbus_mux_add_client (priv->mux, ikbus_cdc_mux_receive, cdc);
+  if (priv->mux_client < 0)
+  {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                         "No room for the CDC on the shared socket");
+    return FALSE;
+  }
+  ikbus_mux_route (priv->mux, priv->mux_client, IKBUS_MUX_ANY, IKBUS_DEV_CDC);
+  ikbus_mux_route (priv->mux, priv->mux_client, IKBUS_MUX_ANY, IKBUS_DEV_LOC);
+  ikbus_mux_route (priv->mux, priv->mux_client, IKBUS_MUX_ANY, IKBUS_DEV_GLO);
 
-  ikbus_socket_write (cdc->priv->iksock, CDC_I_AM_HERE, 5);
   return TRUE;
 }
 
+/* ms */
+static guint
+ikbus_cdc_announce_interval (IKBusCdc *cdc)
+{
+  if (cdc->priv->announce_interval > 0)
+    return cdc->priv->announce_interval * 1000;
+  return cdc_announce_intervals[cdc->priv->head_unit];
+}
+
+/* ms since the changer last sent a frame, -1 if it never did */
+static gint
+ikbus_cdc_tx_idle (IKBusCdc *cdc)
+{
+  gint64 idle;
+
+  /* Only an own socket carries nothing but the changer's frames */
+  if (cdc->priv->mux == NULL)
+    return ikbus_socket_get_tx_idle (cdc->priv->iksock);
+  if (cdc->priv->tx_last == 0)
+    return -1;
+  idle = (g_get_monotonic_time () - cdc->priv->tx_last) / 1000;
+  return (gint) MIN (idle, G_MAXINT);
+}
+
+/*
+ * Announce the changer once the bus has not heard from it for the announce
+ * interval. Any frame it sent meanwhile, a poll reply included, pushes the
+ * announce back; the timer then sleeps just for the time left.
+ */
 static gboolean
-ikbus_cdc_initable_init (GInitable *initable,
-                         GCancellable *cancellable,
-                         GError  **error)
+ikbus_cdc_timeout (gpointer data)
 {
-  g_return_val_if_fail (IKBUS_IS_CDC (initable), FALSE);
-  IKBusCdc *g_cdc = IKBUS_CDC (initable);
+  IKBusCdc *cdc = IKBUS_CDC (data);
+  guint interval = ikbus_cdc_announce_interval (cdc);
+  gint idle;
 
-  g_cdc->priv->iksock = ikbus_socket_new (g_cdc->priv->ifname, error);
-  if (NULL == g_cdc->priv->iksock)
-    return FALSE;
+  idle = ikbus_cdc_tx_idle (cdc);
+  if ((idle < 0) || ((guint) idle >= interval))
+  {
+    ikbus_cdc_send (cdc, CDC_I_AM_HERE, 5, IKBUS_SOCKET_PRIO_ANNOUNCE);
+    idle = 0;
+  }
 
-  if (FALSE == ikbus_socket_connect (g_cdc->priv->iksock, IKBUS_DEV_CDC, IKBUS_DEV_LOC, error))
-    return FALSE;
+  cdc->priv->announce_id = g_timeout_add (interval - idle, ikbus_cdc_timeout, cdc);
+  return G_SOURCE_REMOVE;
+}
 
-  g_cdc->priv->channel = g_io_channel_unix_new (ikbus_socket_get_fd (g_cdc->priv->iksock));
+/* Own socket, watched from the main loop */
+static gboolean
+ikbus_cdc_watch (IKBusCdc *cdc, GError **error)
+{
+  cdc->priv->channel = g_io_channel_unix_new (ikbus_socket_get_fd (cdc->priv->iksock));
 
   /* NULL encoding means the stream is binary safe */
-  g_io_channel_set_encoding (g_cdc->priv->channel, NULL, NULL);
+  g_io_channel_set_encoding (cdc->priv->channel, NULL, NULL);
   /* no buffering */
-  g_io_channel_set_buffered (g_cdc->priv->channel, FALSE);
+  g_io_channel_set_buffered (cdc->priv->channel, FALSE);
 
-  if (!g_io_add_watch (g_cdc->priv->channel, 
-                      G_IO_IN, (GIOFunc) ikbus_cdc_receiving, g_cdc))
+  if (!g_io_add_watch (cdc->priv->channel, 
+                      G_IO_IN | G_IO_HUP | G_IO_ERR, (GIOFunc) ikbus_cdc_receiving, cdc))
   {
     g_set_error (error,
                  G_IO_ERROR,
@@ -323,9 +691,51 @@ ikbus_cdc_initable_init (GInitable *initable,
                  "Fail to add watch CDC channel");
     return FALSE;
   }
-  g_io_channel_unref (g_cdc->priv->channel);
+  g_io_channel_unref (cdc->priv->channel);
+
+  return TRUE;
+}
+
+static gboolean
+ikbus_cdc_initable_init (GInitable *initable,
+                         GCancellable *cancellable,
+                         GError  **error)
+{
+  g_return_val_if_fail (IKBUS_IS_CDC (initable), FALSE);
+  IKBusCdc *g_cdc = IKBUS_CDC (initable);
+
+  if (g_cdc->priv->mux != NULL)
+  {
+    if (!ikbus_cdc_mux_attach (g_cdc, error))
+      return FALSE;
+  }
+  else
+  {
+    g_cdc->priv->iksock = g_initable_new (IKBUS_TYPE_SOCKET, NULL, error,
+                                          "ifname", g_cdc->priv->ifname,
+                                          "io-thread", g_cdc->priv->io_thread,
+                                          "tx-gap", g_cdc->priv->tx_gap, NULL);
+    if (NULL == g_cdc->priv->iksock)
+      return FALSE;
+
+    if (FALSE == ikbus_socket_connect (g_cdc->priv->iksock, IKBUS_DEV_CDC, IKBUS_DEV_LOC, error))
+      return FALSE;
+  }
+
+  /* Status polls are answered by the I/O thread when there is one */
+  if (g_cdc->priv->io_thread)
+  {
+    ikbus_socket_set_auto_reply (g_cdc->priv->iksock, IKBUS_MSG_DEV_STAT_REQ,
+                                 IKBUS_SOCKET_ANY_SUB, CDC_I_AM_HERE, 5);
+    ikbus_cdc_status_changed (g_cdc);
+  }
+
+  if ((g_cdc->priv->mux == NULL) && !ikbus_cdc_watch (g_cdc, error))
+    return FALSE;
 
-  if (!g_timeout_add (3800, ikbus_cdc_timeout, g_cdc))
+  g_cdc->priv->announce_id = g_timeout_add (ikbus_cdc_announce_interval (g_cdc),
+                                            ikbus_cdc_timeout, g_cdc);
+  if (!g_cdc->priv->announce_id)
   {
     g_set_error (error,
                  G_IO_ERROR,
@@ -334,7 +744,7 @@ ikbus_cdc_initable_init (GInitable *initable,
     return FALSE;
   }
 
-  ikbus_socket_write (g_cdc->priv->iksock, CDC_ANNOUNCE, 5);
+  ikbus_cdc_send (g_cdc, CDC_ANNOUNCE, 5, IKBUS_SOCKET_PRIO_ANNOUNCE);
 
   return TRUE;
 }
@@ -361,6 +771,39 @@ ikbus_cdc_class_init (IKBusCdcClass *klass)
                                     NULL, /* default */
                                     G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
 
+  obj_properties[PROP_HEAD_UNIT] = g_param_spec_uint ("head-unit",
+                                    "Head unit",
+                                    "Type of the controlling head unit, IKBusCdcHeadUnit",
+                                    0, IKBUS_CDC_HEAD_UNIT_LAST - 1,
+                                    IKBUS_CDC_HEAD_UNIT_GENERIC, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  obj_properties[PROP_ANNOUNCE_INTERVAL] = g_param_spec_uint ("announce-interval",
+                                    "Announce interval",
+                                    "Seconds without traffic before the changer announces itself, 0 for the head unit default",
+                                    0, CDC_ANNOUNCE_MAX,
+                                    0, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  obj_properties[PROP_IO_THREAD] = g_param_spec_boolean ("io-thread",
+                                    "I/O thread",
+                                    "Serve the bus from a dedicated thread of the socket",
+                                    FALSE, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  obj_properties[PROP_MUX] = g_param_spec_object ("mux",
+                                    "Multiplexer",
+                                    "Shared bus socket to use instead of an own one",
+                                    IKBUS_TYPE_MUX,
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  obj_properties[PROP_TX_GAP] = g_param_spec_uint ("tx-gap",
+                                    "TX gap",
+                                    "Silence after each frame on the wire in us, 0 writes frames at once",
+                                    0, G_USEC_PER_SEC,
+                                    0, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
   g_object_class_install_properties (object_class, N_PROP, obj_properties);
 
   signals[REQ_STATUS] = g_signal_new ("req-status",
@@ -439,7 +882,7 @@ ikbus_cdc_class_init (IKBusCdcClass *klass)
                                0,
                                NULL,
                                NULL,
-                               g_cclosure_marshal_VOID__VOID,
+                               g_cclosure_marshal_VOID__UCHAR,
                                G_TYPE_NONE,
                                1, G_TYPE_UCHAR);
 
@@ -489,31 +932,20 @@ static void
 ikbus_cdc_init (IKBusCdc *cdc)
 {
   cdc->priv = ikbus_cdc_get_instance_private (cdc);
+  cdc->priv->mux_client = -1;
 
-  /* Bind cdc fields to buffer's addresses */
-  cdc->priv->msg_cmd = cdc->priv->rx_buf + 3;
-  cdc->priv->ctrl_task = cdc->priv->rx_buf + 4;
-  cdc->priv->ctrl_arg  = cdc->priv->rx_buf + 5;
-
-  cdc->priv->stat_resp  = cdc->priv->tx_buf + 4;
-  cdc->priv->ack_resp   = cdc->priv->tx_buf + 5;
-  cdc->priv->error_mask = cdc->priv->tx_buf + 6;
-  cdc->priv->cd_mask    = cdc->priv->tx_buf + 7;
-  cdc->priv->cdnum  = cdc->priv->tx_buf + 9;
-  cdc->priv->tracknum = cdc->priv->tx_buf + 10;
-
-  /* Set default values for TX message */
-  cdc->priv->tx_buf[IKBUS_FRM_SENDER] = IKBUS_DEV_CDC; /* Sender address */
-  cdc->priv->tx_buf[IKBUS_FRM_SIZE] = 10; /* Message length */
-  cdc->priv->tx_buf[IKBUS_FRM_RECEIVER] = IKBUS_DEV_RAD; /* Receiver address */
-
-  cdc->priv->tx_buf[IKBUS_FRM_CMD] = IKBUS_MSG_CD_STAT;
-  *cdc->priv->stat_resp = CDC_STAT_STOP;
-  *cdc->priv->ack_resp = CDC_ACK_PAUSE;
-  *cdc->priv->error_mask = 0;
-  *cdc->priv->cd_mask = 0;
-  *cdc->priv->cdnum = 0;
-  *cdc->priv->tracknum = 0;
+  /* Messages handled by the changer */
+  cdc->priv->messages[IKBUS_MSG_DEV_STAT_REQ].func = ikbus_cdc_msg_stat_req;
+  cdc->priv->messages[IKBUS_MSG_CD_CTL].func = ikbus_cdc_msg_cd_ctl;
+  cdc->priv->messages[IKBUS_DIA_READ_IDENT].func = ikbus_cdc_msg_ident;
+
+  /* Default CD status */
+  cdc->priv->stat_resp = CDC_STAT_STOP;
+  cdc->priv->ack_resp = CDC_ACK_PAUSE;
+  cdc->priv->error_mask = 0;
+  cdc->priv->cd_mask = 0;
+  cdc->priv->cdnum = 0;
+  cdc->priv->tracknum = 0;
 
   cdc->priv->real_tracknum = 0;
 }
@@ -525,12 +957,60 @@ ikbus_cdc_new (gchar *ifname, GError **error)
                                     error, "ifname", ifname, NULL));
 }
 
+/* Bus socket of the changer, owned by the changer */
+IKBusSocket *
+ikbus_cdc_get_socket (IKBusCdc *cdc)
+{
+  g_return_val_if_fail (IKBUS_IS_CDC (cdc), NULL);
+
+  return cdc->priv->iksock;
+}
+
 void
 ikbus_cdc_sync_output (IKBusCdc *cdc, GError **error)
 {
   g_return_if_fail (IKBUS_IS_CDC (cdc));
 
-  ikbus_socket_write (cdc->priv->iksock, cdc->priv->tx_buf, 11);
+  ikbus_cdc_send_status (cdc, IKBUS_SOCKET_PRIO_STATE);
+}
+
+/*
+ * Number of received frames dropped for the given reason. On a shared
+ * socket malformed frames never reach the changer, the mux counts them.
+ */
+guint64
+ikbus_cdc_get_drop_count (IKBusCdc *cdc, IKBusCdcDrop reason)
+{
+  g_return_val_if_fail (IKBUS_IS_CDC (cdc), 0);
+  g_return_val_if_fail (reason < IKBUS_CDC_DROP_LAST, 0);
+
+  if (cdc->priv->mux != NULL)
+    switch (reason)
+      {
+      case IKBUS_CDC_DROP_TOO_SHORT:
+        return ikbus_mux_get_drop_count (cdc->priv->mux, IKBUS_FRAME_TOO_SHORT);
+      case IKBUS_CDC_DROP_BAD_LENGTH:
+        return ikbus_mux_get_drop_count (cdc->priv->mux, IKBUS_FRAME_BAD_LENGTH) +
+               cdc->priv->drops[reason];
+      case IKBUS_CDC_DROP_BAD_CHECKSUM:
+        return ikbus_mux_get_drop_count (cdc->priv->mux, IKBUS_FRAME_BAD_CHECKSUM);
+      default:
+        break;
+      }
+
+  return cdc->priv->drops[reason];
+}
+
+/* Number of CD status frames sent as prebuilt and rebuilt after a change */
+void
+ikbus_cdc_get_cache_stats (IKBusCdc *cdc, guint64 *hits, guint64 *misses)
+{
+  g_return_if_fail (IKBUS_IS_CDC (cdc));
+
+  if (hits != NULL)
+    *hits = cdc->priv->cache_hits;
+  if (misses != NULL)
+    *misses = cdc->priv->cache_misses;
 }
 
 static guint8
@@ -545,7 +1025,8 @@ ikbus_cdc_set_track (IKBusCdc *cdc, gint tracknum)
   g_return_if_fail (IKBUS_IS_CDC (cdc));
 
   cdc->priv->real_tracknum = tracknum;
-  *cdc->priv->tracknum = ikbus_cdc_hex_like_dec ((guint8) tracknum);
+  cdc->priv->tracknum = ikbus_cdc_hex_like_dec ((guint8) tracknum);
+  ikbus_cdc_status_changed (cdc);
 }
 
 gint
@@ -556,17 +1037,38 @@ ikbus_cdc_get_track (IKBusCdc *cdc)
   return (gint) cdc->priv->real_tracknum;
 }
 
+/* Page of IKBUS_CDC_PAGE_SIZE discs holding the given disc */
+static inline guint
+ikbus_cdc_page_of (guint vdisc)
+{
+  return (vdisc > 0) ? (vdisc - 1) / IKBUS_CDC_PAGE_SIZE : 0;
+}
+
+/* Derive the six protocol visible discs from the virtual magazine */
+static void
+ikbus_cdc_update_page (IKBusCdc *cdc)
+{
+  IKBusCdcPrivate *priv = cdc->priv;
+  guint page = ikbus_cdc_page_of (priv->vdisc);
+
+  priv->cd_mask = (priv->disc_mask >> (page * IKBUS_CDC_PAGE_SIZE)) &
+                  ((1 << IKBUS_CDC_PAGE_SIZE) - 1);
+  priv->cdnum = (priv->vdisc > 0) ? priv->vdisc - page * IKBUS_CDC_PAGE_SIZE : 0;
+}
+
 void
 ikbus_cdc_set_cd (IKBusCdc *cdc, gint cdnum)
 {
-  guint8 tmp_mask = 0;
   g_return_if_fail (IKBUS_IS_CDC (cdc));
 
-  if ((cdnum >= 1) && (cdnum <= 6))
+  if ((cdnum >= 1) && (cdnum <= IKBUS_CDC_MAX_DISCS))
   {
-    tmp_mask = 1 << (cdnum - 1);
-    if (tmp_mask & (*cdc->priv->cd_mask))
-            *cdc->priv->cdnum = (guint8) cdnum;
+    if (cdc->priv->disc_mask & (G_GUINT64_CONSTANT (1) << (cdnum - 1)))
+    {
+      cdc->priv->vdisc = cdnum;
+      ikbus_cdc_update_page (cdc);
+      ikbus_cdc_status_changed (cdc);
+    }
   }
 }
 
@@ -575,7 +1077,55 @@ ikbus_cdc_get_cd (IKBusCdc *cdc)
 {
   g_return_val_if_fail (IKBUS_IS_CDC (cdc), -1);
 
-  return (gint) *cdc->priv->cdnum;
+  return (gint) cdc->priv->vdisc;
+}
+
+/*
+ * Translate the disc asked for by the last CHNG_CD command into the virtual
+ * magazine. The radio only knows six discs, so when it wraps around from the
+ * last present disc of the page to the first one (or back) the next (or
+ * previous) page with discs is selected instead.
+ */
+gint
+ikbus_cdc_get_requested_cd (IKBusCdc *cdc)
+{
+  IKBusCdcPrivate *priv;
+  guint64 mask, rest;
+  guint page, req, lowest, highest, base;
+  g_return_val_if_fail (IKBUS_IS_CDC (cdc), -1);
+
+  priv = cdc->priv;
+  req = priv->ctrl_arg;
+  page = ikbus_cdc_page_of (priv->vdisc);
+  base = page * IKBUS_CDC_PAGE_SIZE;
+  if ((req < 1) || (req > IKBUS_CDC_PAGE_SIZE) || (priv->cd_mask == 0))
+    return -1;
+
+  /* All discs are on this page */
+  if (__builtin_popcountll (priv->disc_mask) == __builtin_popcount (priv->cd_mask))
+    return base + req;
+
+  lowest = __builtin_ctz (priv->cd_mask) + 1;
+  highest = 32 - __builtin_clz (priv->cd_mask);
+
+  if ((priv->cdnum == highest) && (req == lowest) && (req != highest))
+  {
+    /* Forward wrap: first disc after this page, or the very first */
+    base += IKBUS_CDC_PAGE_SIZE;
+    mask = (base < 64) ? priv->disc_mask & ~((G_GUINT64_CONSTANT (1) << base) - 1) : 0;
+    rest = mask ? mask : priv->disc_mask;
+    return __builtin_ctzll (rest) + 1;
+  }
+
+  if ((priv->cdnum == lowest) && (req == highest) && (req != lowest))
+  {
+    /* Backward wrap: last disc before this page, or the very last */
+    mask = priv->disc_mask & ((G_GUINT64_CONSTANT (1) << base) - 1);
+    rest = mask ? mask : priv->disc_mask;
+    return 64 - __builtin_clzll (rest);
+  }
+
+  return base + req;
 }
 
 guint8
@@ -583,7 +1133,7 @@ ikbus_cdc_get_cmd_arg (IKBusCdc *cdc)
 {
   g_return_val_if_fail (IKBUS_IS_CDC (cdc), 0);
 
-  return *cdc->priv->ctrl_arg;
+  return cdc->priv->ctrl_arg;
 }
 
 void
@@ -591,7 +1141,8 @@ ikbus_cdc_set_resp_status (IKBusCdc *cdc, guint8 stat)
 {
   g_return_if_fail (IKBUS_IS_CDC (cdc));
 
-  *cdc->priv->stat_resp = stat;
+  cdc->priv->stat_resp = stat;
+  ikbus_cdc_status_changed (cdc);
 }
 
 void
@@ -599,7 +1150,8 @@ ikbus_cdc_set_resp_request (IKBusCdc *cdc, guint8 req)
 {
   g_return_if_fail (IKBUS_IS_CDC (cdc));
 
-  *cdc->priv->ack_resp = req;
+  cdc->priv->ack_resp = req;
+  ikbus_cdc_status_changed (cdc);
 }
 
 void
@@ -607,50 +1159,49 @@ ikbus_cdc_set_error (IKBusCdc *cdc, guint8 errmask)
 {
   g_return_if_fail (IKBUS_IS_CDC (cdc));
 
-  *cdc->priv->error_mask = errmask;
+  cdc->priv->error_mask = errmask;
+  ikbus_cdc_status_changed (cdc);
 }
 
 void
 ikbus_cdc_insert_cd (IKBusCdc *cdc, guint8 cdnum)
 {
-  guint8 tmp_mask = 0;
   g_return_if_fail (IKBUS_IS_CDC (cdc));
 
-  if ((cdnum >= 1) && (cdnum <= 6))
+  if ((cdnum >= 1) && (cdnum <= IKBUS_CDC_MAX_DISCS))
   {
-    tmp_mask = 1 << (cdnum - 1);
-    if (*cdc->priv->cd_mask == 0)
+    if (cdc->priv->disc_mask == 0)
     {
-      *cdc->priv->cdnum = cdnum;
-      *cdc->priv->stat_resp = CDC_STAT_STOP;
+      cdc->priv->vdisc = cdnum;
+      cdc->priv->stat_resp = CDC_STAT_STOP;
     }
-    *cdc->priv->cd_mask |= tmp_mask;
+    cdc->priv->disc_mask |= G_GUINT64_CONSTANT (1) << (cdnum - 1);
+    ikbus_cdc_update_page (cdc);
+    ikbus_cdc_status_changed (cdc);
   }
 }
 
 gint
 ikbus_cdc_remove_cd (IKBusCdc *cdc, guint8 cdnum)
 {
-  guint8 tmp_mask = 0;
   g_return_val_if_fail (IKBUS_IS_CDC (cdc), -1);
 
-  if ((cdnum >= 1) && (cdnum <= 6))
+  if ((cdnum >= 1) && (cdnum <= IKBUS_CDC_MAX_DISCS))
   {
-    tmp_mask = 1 << (cdnum - 1);
-    *cdc->priv->cd_mask &= ~tmp_mask;
-    if (*cdc->priv->cd_mask == 0)
+    cdc->priv->disc_mask &= ~(G_GUINT64_CONSTANT (1) << (cdnum - 1));
+    if (cdc->priv->disc_mask == 0)
     {
-      *cdc->priv->cdnum = 0;
-      *cdc->priv->stat_resp = CDC_STAT_NO_MAGAZINE;
+      cdc->priv->vdisc = 0;
+      cdc->priv->stat_resp = CDC_STAT_NO_MAGAZINE;
     }
-    else if (*cdc->priv->cdnum == cdnum)
+    else if (cdc->priv->vdisc == cdnum)
     {
-      guint8 i;
-      for (i = 0; (i < 6) && !(1 & (*cdc->priv->cd_mask >> i)); i++);
-      *cdc->priv->cdnum = i + 1;
+      cdc->priv->vdisc = __builtin_ctzll (cdc->priv->disc_mask) + 1;
     }
+    ikbus_cdc_update_page (cdc);
+    ikbus_cdc_status_changed (cdc);
   }
-  return *cdc->priv->cdnum;
+  return cdc->priv->vdisc;
 }
 
 void
@@ -662,10 +1213,12 @@ ikbus_cdc_sync_set (IKBusCdc *cdc,const gchar *first_cmd_name, ...)
   va_start (var_args, first_cmd_name);
   if (first_cmd_name)
     {
+      GError *error = NULL;
       const gchar *name;
       int tmp_diasc;
       name = first_cmd_name;
       tmp_diasc = ikbus_cdc_get_cd (cdc);
+      ikbus_socket_tx_begin (cdc->priv->iksock);
       do
         {
           gint value;
@@ -690,6 +1243,11 @@ ikbus_cdc_sync_set (IKBusCdc *cdc,const gchar *first_cmd_name, ...)
       while ((name = va_arg (var_args, const gchar *)));
       ikbus_cdc_set_cd (cdc, tmp_diasc); /* first set cdmask value, after disk */
       ikbus_cdc_sync_output (cdc, NULL);
+      if (!ikbus_socket_tx_end (cdc->priv->iksock, &error))
+        {
+          g_warning ("CDC: %s\n", error->message);
+          g_clear_error (&error);
+        }
     }
   va_end (var_args);
 }
@@ -704,7 +1262,8 @@ ikbus_cdc_set_random_mid (IKBusCdc *cdc, gboolean rand)
 
   g_return_if_fail (IKBUS_IS_CDC (cdc));
 
-  ikbus_socket_write (cdc->priv->iksock, mid_press_button_random, 7);
-  g_usleep (150000);
-  ikbus_socket_write (cdc->priv->iksock, mid_release_button_random, 7);
+  ikbus_socket_write_full (cdc->priv->iksock, mid_press_button_random, 7,
+                           IKBUS_SOCKET_PRIO_INPUT, 0);
+  ikbus_socket_write_full (cdc->priv->iksock, mid_release_button_random, 7,
+                           IKBUS_SOCKET_PRIO_INPUT, CDC_MID_BUTTON_HOLD);
 }
@@ -22,6 +22,7 @@
 #define _IKBUSCCDC_H_
 
 #include <glib-object.h>
+#include "ikbussocket.h"
 
 #define CDC_STAT_STOP                0x00
 #define CDC_STAT_PAUSE               0x01
@@ -52,6 +53,9 @@
 #define CDC_CD5                      1 << 4
 #define CDC_CD6                      1 << 5
 
+#define IKBUS_CDC_PAGE_SIZE          6      /* Discs the radio can see */
+#define IKBUS_CDC_MAX_DISCS          64     /* Discs in the virtual magazine */
+
 #define CDC_CMD_STAT_REQ             0x00
 #define CDC_CMD_STOP                 0x01
 #define CDC_CMD_PAUSE                0x02
@@ -65,6 +69,25 @@
 
 G_BEGIN_DECLS
 
+/* Reasons for dropping received frames */
+typedef enum {
+  IKBUS_CDC_DROP_TOO_SHORT,
+  IKBUS_CDC_DROP_BAD_LENGTH,
+  IKBUS_CDC_DROP_BAD_CHECKSUM,
+  IKBUS_CDC_DROP_RECEIVER,        /* Addressed to another device */
+  IKBUS_CDC_DROP_MESSAGE,         /* No handler for the message type */
+  IKBUS_CDC_DROP_COMMAND,         /* Unknown CD control command */
+  IKBUS_CDC_DROP_LAST
+} IKBusCdcDrop;
+
+/* Head units, by how often they need the changer to announce itself */
+typedef enum {
+  IKBUS_CDC_HEAD_UNIT_GENERIC,    /* Announce every 3.8 s, like the original changer */
+  IKBUS_CDC_HEAD_UNIT_BUSINESS,   /* Polls the changer on its own, 20 s */
+  IKBUS_CDC_HEAD_UNIT_NAVIGATION, /* Polls the changer on its own, 30 s */
+  IKBUS_CDC_HEAD_UNIT_LAST
+} IKBusCdcHeadUnit;
+
 #define IKBUS_TYPE_CDC               (ikbus_cdc_get_type())
 #define IKBUS_CDC(obj)               ((G_TYPE_CHECK_INSTANCE_CAST ((obj), IKBUS_TYPE_CDC, IKBusCdc)))
 #define IKBUS_CDC_CLASS(klass)       ((G_TYPE_CHECK_CLASS_CAST ((klass), IKBUS_TYPE_CDC, IKBusCdcClass)))
@@ -76,6 +99,9 @@ typedef struct _IKBusCdc        IKBusCdc;
 typedef struct _IKBusCdcClass   IKBusCdcClass;
 typedef struct _IKBusCdcPrivate IKBusCdcPrivate;
 
+typedef void (*IKBusCdcMessageFunc) (IKBusCdc *cdc, const IKBusFrame *frame,
+                                     gpointer user_data);
+
 struct _IKBusCdc {
   GObject parent_instance;
   IKBusCdcPrivate *priv;
@@ -88,12 +114,16 @@ struct _IKBusCdcClass {
 GType ikbus_cdc_get_type (void);
 
 IKBusCdc *ikbus_cdc_new (gchar *ifname, GError **error);
+IKBusSocket *ikbus_cdc_get_socket (IKBusCdc *cdc);
 void ikbus_cdc_sync_output (IKBusCdc *cdc, GError **error);
+void ikbus_cdc_get_cache_stats (IKBusCdc *cdc, guint64 *hits, guint64 *misses);
+guint64 ikbus_cdc_get_drop_count (IKBusCdc *cdc, IKBusCdcDrop reason);
 
 void ikbus_cdc_set_track (IKBusCdc *cdc, gint tracknum);
 gint ikbus_cdc_get_track (IKBusCdc *cdc);
 void ikbus_cdc_set_cd (IKBusCdc *cdc, gint cdnum);
 gint ikbus_cdc_get_cd (IKBusCdc *cdc);
+gint ikbus_cdc_get_requested_cd (IKBusCdc *cdc);
 gboolean ikbus_cdc_get_random (IKBusCdc *cdc);
 
 guint8 ikbus_cdc_get_cmd_arg (IKBusCdc *cdc);
@@ -107,5 +137,8 @@ gint ikbus_cdc_remove_cd (IKBusCdc *cdc, guint8 cdnum);
 void ikbus_cdc_sync_set (IKBusCdc *cdc,const gchar *first_cmd_name, ...);
 
 void ikbus_cdc_set_random_mid (IKBusCdc *cdc, gboolean rand);
+
+void ikbus_cdc_register_message (IKBusCdc *cdc, guint8 msg,
+                                 IKBusCdcMessageFunc func, gpointer user_data);
 G_END_DECLS
 #endif /* _IKBUSCDC_H_ */
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IKBUSDEFS_H_
+#define _IKBUSDEFS_H_
+
+/*
+ * Frame layout, device addresses and message types. Taken from the kernel
+ * headers when they are installed, otherwise the subset used here is defined
+ * so the userspace transports build on any Linux box.
+ */
+#ifdef HAVE_IKBUS_HDRS
+#include <linux/ikbusframe.h>
+#else
+
+#define IKBUS_MAX_FRAME_SIZE         64
+
+/* Frame fields */
+#define IKBUS_FRM_SENDER             0
+#define IKBUS_FRM_SIZE               1
+#define IKBUS_FRM_RECEIVER           2
+#define IKBUS_FRM_CMD                3
+
+/* Devices */
+#define IKBUS_DEV_CDC                0x18
+#define IKBUS_DEV_MID                0xc0
+#define IKBUS_DEV_RAD                0x68
+#define IKBUS_DEV_DIA                0x3f
+#define IKBUS_DEV_GLO                0xbf
+#define IKBUS_DEV_LOC                0xff
+
+/* Messages */
+#define IKBUS_DIA_READ_IDENT         0x00
+#define IKBUS_MSG_DEV_STAT_REQ       0x01
+#define IKBUS_MSG_DEV_STAT_READY     0x02
+#define IKBUS_MSG_BUTTON             0x31
+#define IKBUS_MSG_CD_CTL             0x38
+#define IKBUS_MSG_CD_STAT            0x39
+#define IKBUS_MSG_DIA_ACK            0xa0
+
+#endif /* HAVE_IKBUS_HDRS */
+
+#endif /* _IKBUSDEFS_H_ */
@@ -0,0 +1,474 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * One bus socket shared by the device objects of a process. The socket
+ * takes every frame on the bus the clients are routed for, each one is
+ * handed to the clients routed for its sender and receiver.
+ */
+
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <string.h>
+#include <errno.h>
+#include "ikbusmux.h"
+
+typedef struct
+{
+  IKBusMuxFunc func;
+  gpointer user_data;
+} IKBusMuxClient;
+
+typedef struct
+{
+  gint client;
+  IKBusSocketSubscription sub;
+} IKBusMuxRoute;
+
+struct _IKBusMuxPrivate
+{
+  gchar *ifname;
+  gboolean io_thread;
+  guint tx_gap;                   /* us, passed to the socket */
+  IKBusSocket *iksock;
+  guint watch;
+
+  IKBusMuxClient clients[IKBUS_MUX_MAX_CLIENTS];
+  guint32 used;                   /* Bit n set if clients[n] is taken */
+
+  /*
+   * Masks of the clients a frame goes to. Rows of routes are indexed by
+   * receiver and allocated for a sender on its first route, any_sender
+   * holds the routes for all senders.
+   */
+  guint32 *routes[256];
+  guint32 any_sender[256];
+  GArray *route_list;             /* IKBusMuxRoute, to rebuild the socket filter */
+
+  IKBusSocketFrame rx_frames[IKBUS_SOCKET_BATCH_SIZE];
+  guint64 unrouted;               /* Frames no client was routed for */
+  guint64 drops[IKBUS_FRAME_BAD_CHECKSUM + 1]; /* Malformed frames by IKBusFrameStatus */
+};
+
+static void ikbus_mux_initable_iface_init (GInitableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (IKBusMux, ikbus_mux, G_TYPE_OBJECT,
+    G_ADD_PRIVATE (IKBusMux) G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, ikbus_mux_initable_iface_init))
+
+enum
+{
+  PROP_0,
+  PROP_IFNAME,
+  PROP_IO_THREAD,
+  PROP_TX_GAP,
+  N_PROP
+};
+
+static GParamSpec *obj_properties[N_PROP] = { NULL, };
+
+static void
+ikbus_mux_finalize (GObject *object)
+{
+  IKBusMux *mux = IKBUS_MUX (object);
+  guint i;
+
+  for (i = 0; i < 256; i++)
+    g_free (mux->priv->routes[i]);
+  g_array_free (mux->priv->route_list, TRUE);
+  g_free (mux->priv->ifname);
+  G_OBJECT_CLASS (ikbus_mux_parent_class)->finalize (object);
+}
+
+static void
+ikbus_mux_dispose (GObject *object)
+{
+  IKBusMux *mux = IKBUS_MUX (object);
+
+  if (mux->priv->watch != 0)
+  {
+    g_source_remove (mux->priv->watch);
+    mux->priv->watch = 0;
+  }
+  g_clear_object (&mux->priv->iksock);
+  G_OBJECT_CLASS (ikbus_mux_parent_class)->dispose (object);
+}
+
+static void
+ikbus_mux_get_property (GObject *object,
+                        guint property_id,
+                        GValue *value,
+                        GParamSpec *pspec)
+{
+  IKBusMux *mux = IKBUS_MUX (object);
+
+  switch (property_id)
+    {
+      case PROP_IFNAME:
+        g_value_set_string (value, mux->priv->ifname);
+        break;
+      case PROP_IO_THREAD:
+        g_value_set_boolean (value, mux->priv->io_thread);
+        break;
+      case PROP_TX_GAP:
+        g_value_set_uint (value, mux->priv->tx_gap);
+        break;
+
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+ikbus_mux_set_property (GObject *object,
+                        guint property_id,
+                        const GValue *value,
+                        GParamSpec *pspec)
+{
+  IKBusMux *mux = IKBUS_MUX (object);
+
+  switch (property_id)
+    {
+      case PROP_IFNAME:
+        g_free (mux->priv->ifname);
+        mux->priv->ifname = g_strdup (g_value_get_string (value));
+        break;
+      case PROP_IO_THREAD:
+        mux->priv->io_thread = g_value_get_boolean (value);
+        break;
+      case PROP_TX_GAP:
+        mux->priv->tx_gap = g_value_get_uint (value);
+        break;
+
+      default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static inline guint32
+ikbus_mux_lookup (IKBusMuxPrivate *priv, guint8 sender, guint8 receiver)
+{
+  guint32 mask = priv->any_sender[receiver];
+
+  if (priv->routes[sender] != NULL)
+    mask |= priv->routes[sender][receiver];
+  return mask;
+}
+
+static gboolean
+ikbus_mux_receiving (G_GNUC_UNUSED gint fd,
+                     G_GNUC_UNUSED GIOCondition condition,
+                     gpointer data)
+{
+  IKBusMux *mux = IKBUS_MUX (data);
+  IKBusMuxPrivate *priv = mux->priv;
+  IKBusSocketFrame *raw;
+  IKBusMuxClient *client;
+  IKBusFrame view;
+  IKBusFrameStatus status;
+  GError *error = NULL;
+  guint32 mask;
+  gint i, n, c;
+
+  n = ikbus_socket_read_batch (priv->iksock, priv->rx_frames, IKBUS_SOCKET_BATCH_SIZE);
+  if (n < 0)
+  {
+    /* Hung up or failed, the socket would stay readable */
+    g_warning ("Mux: stopped reading the bus: %s\n", g_strerror (errno));
+    priv->watch = 0;
+    return G_SOURCE_REMOVE;
+  }
+
+  /* Replies of all clients leave with one flush */
+  ikbus_socket_tx_begin (priv->iksock);
+  for (i = 0; i < n; i++)
+  {
+    raw = &priv->rx_frames[i];
+    status = ikbus_frame_parse (&view, raw->data, raw->nbytes);
+    if (status != IKBUS_FRAME_OK)
+    {
+      priv->drops[status]++;
+      continue;
+    }
+    view.flags = raw->flags;
+
+    mask = ikbus_mux_lookup (priv, view.sender, view.receiver);
+    if (mask == 0)
+      priv->unrouted++;
+
+    for (c = g_bit_nth_lsf (mask, -1); c >= 0; c = g_bit_nth_lsf (mask, c))
+    {
+      /* A client may leave while the batch is dispatched */
+      client = &priv->clients[c];
+      if (client->func != NULL)
+        client->func (&view, client->user_data);
+    }
+  }
+  if (!ikbus_socket_tx_end (priv->iksock, &error))
+  {
+    g_warning ("Mux: %s\n", error->message);
+    g_clear_error (&error);
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Let the kernel drop frames no client is routed for. Without room for all
+ * routes the socket takes everything and the routing table sorts it out.
+ */
+static void
+ikbus_mux_update_filter (IKBusMux *mux)
+{
+  IKBusSocketSubscription subs[IKBUS_SOCKET_SUBSCRIPTIONS_MAX];
+  const IKBusMuxRoute *route;
+  GError *error = NULL;
+  guint i, j, n = 0;
+
+  for (i = 0; i < mux->priv->route_list->len; i++)
+  {
+    route = &g_array_index (mux->priv->route_list, IKBusMuxRoute, i);
+    for (j = 0; j < n; j++)
+      if ((subs[j].sender == route->sub.sender) && (subs[j].receiver == route->sub.receiver))
+        break;
+    if (j < n)
+      continue;
+    if (n == IKBUS_SOCKET_SUBSCRIPTIONS_MAX)
+    {
+      n = 0;
+      break;
+    }
+    subs[n++] = route->sub;
+  }
+
+  if (!ikbus_socket_set_subscriptions (mux->priv->iksock, subs, n, &error))
+  {
+    g_debug ("Mux: %s", error->message);
+    g_clear_error (&error);
+  }
+}
+
+/**
+ * ikbus_mux_add_client:
+ * Register func for the frames routed to a new client with
+ * ikbus_mux_route(). Returns the client or -1 if there is no room.
+ */
+gint
+ikbus_mux_add_client (IKBusMux *mux, IKBusMuxFunc func, gpointer user_data)
+{
+  gint client;
+
+  g_return_val_if_fail (IKBUS_IS_MUX (mux), -1);
+  g_return_val_if_fail (func != NULL, -1);
+
+  client = g_bit_nth_lsf (~mux->priv->used, -1);
+  if ((client < 0) || (client >= IKBUS_MUX_MAX_CLIENTS))
+    return -1;
+
+  mux->priv->used |= 1u << client;
+  mux->priv->clients[client].func = func;
+  mux->priv->clients[client].user_data = user_data;
+
+  return client;
+}
+
+/* Forget the client and all its routes */
+void
+ikbus_mux_remove_client (IKBusMux *mux, gint client)
+{
+  guint32 keep;
+  guint i, j;
+
+  g_return_if_fail (IKBUS_IS_MUX (mux));
+  g_return_if_fail (client >= 0 && client < IKBUS_MUX_MAX_CLIENTS);
+
+  keep = ~(1u << client);
+  for (i = 0; i < 256; i++)
+  {
+    mux->priv->any_sender[i] &= keep;
+    if (mux->priv->routes[i] != NULL)
+      for (j = 0; j < 256; j++)
+        mux->priv->routes[i][j] &= keep;
+  }
+
+  mux->priv->used &= keep;
+  mux->priv->clients[client].func = NULL;
+  mux->priv->clients[client].user_data = NULL;
+
+  for (i = mux->priv->route_list->len; i > 0; i--)
+    if (g_array_index (mux->priv->route_list, IKBusMuxRoute, i - 1).client == client)
+      g_array_remove_index_fast (mux->priv->route_list, i - 1);
+  ikbus_mux_update_filter (mux);
+}
+
+/**
+ * ikbus_mux_route:
+ * Deliver frames from sender to receiver to the client, either address
+ * may be IKBUS_MUX_ANY. A frame matching several routes of a client is
+ * delivered once.
+ */
+gboolean
+ikbus_mux_route (IKBusMux *mux, gint client, gint sender, gint receiver)
+{
+  IKBusMuxPrivate *priv;
+  IKBusMuxRoute route;
+  guint32 *row, bit;
+  guint i;
+
+  g_return_val_if_fail (IKBUS_IS_MUX (mux), FALSE);
+  g_return_val_if_fail (client >= 0 && client < IKBUS_MUX_MAX_CLIENTS, FALSE);
+  g_return_val_if_fail (sender >= IKBUS_MUX_ANY && sender <= 0xff, FALSE);
+  g_return_val_if_fail (receiver >= IKBUS_MUX_ANY && receiver <= 0xff, FALSE);
+
+  priv = mux->priv;
+  bit = 1u << client;
+  if (!(priv->used & bit))
+    return FALSE;
+
+  if (sender == IKBUS_MUX_ANY)
+    row = priv->any_sender;
+  else
+  {
+    if (priv->routes[sender] == NULL)
+      priv->routes[sender] = g_new0 (guint32, 256);
+    row = priv->routes[sender];
+  }
+
+  if (receiver == IKBUS_MUX_ANY)
+    for (i = 0; i < 256; i++)
+      row[i] |= bit;
+  else
+    row[receiver] |= bit;
+
+  route.client = client;
+  route.sub.sender = sender;
+  route.sub.receiver = receiver;
+  route.sub.cmd = IKBUS_SOCKET_ANY;
+  g_array_append_val (priv->route_list, route);
+  ikbus_mux_update_filter (mux);
+
+  return TRUE;
+}
+
+/* Shared socket, for writing. Owned by the mux */
+IKBusSocket *
+ikbus_mux_get_socket (IKBusMux *mux)
+{
+  g_return_val_if_fail (IKBUS_IS_MUX (mux), NULL);
+
+  return mux->priv->iksock;
+}
+
+/* Number of received frames no client was routed for */
+guint64
+ikbus_mux_get_unrouted (IKBusMux *mux)
+{
+  g_return_val_if_fail (IKBUS_IS_MUX (mux), 0);
+
+  return mux->priv->unrouted;
+}
+
+/* Number of received frames dropped as malformed, by ikbus_frame_parse() status */
+guint64
+ikbus_mux_get_drop_count (IKBusMux *mux, IKBusFrameStatus status)
+{
+  g_return_val_if_fail (IKBUS_IS_MUX (mux), 0);
+  g_return_val_if_fail (status <= IKBUS_FRAME_BAD_CHECKSUM, 0);
+
+  return mux->priv->drops[status];
+}
+
+static gboolean
+ikbus_mux_initable_init (GInitable *initable,
+                         GCancellable *cancellable,
+                         GError  **error)
+{
+  IKBusMux *mux;
+
+  g_return_val_if_fail (IKBUS_IS_MUX (initable), FALSE);
+  mux = IKBUS_MUX (initable);
+
+  mux->priv->iksock = g_initable_new (IKBUS_TYPE_SOCKET, NULL, error,
+                                      "ifname", mux->priv->ifname,
+                                      "io-thread", mux->priv->io_thread,
+                                      "tx-gap", mux->priv->tx_gap, NULL);
+  if (mux->priv->iksock == NULL)
+    return FALSE;
+
+  /* Every frame on the bus, the routing table sorts them out */
+  if (!ikbus_socket_connect (mux->priv->iksock, IKBUS_DEV_LOC, IKBUS_DEV_LOC, error))
+    return FALSE;
+
+  mux->priv->watch = g_unix_fd_add (ikbus_socket_get_fd (mux->priv->iksock),
+                                    G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                    ikbus_mux_receiving, mux);
+
+  return TRUE;
+}
+
+static void
+ikbus_mux_initable_iface_init (GInitableIface *iface)
+{
+  iface->init = ikbus_mux_initable_init;
+}
+
+static void
+ikbus_mux_class_init (IKBusMuxClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = ikbus_mux_finalize;
+  object_class->dispose = ikbus_mux_dispose;
+  object_class->get_property = ikbus_mux_get_property;
+  object_class->set_property = ikbus_mux_set_property;
+
+  obj_properties[PROP_IFNAME] = g_param_spec_string ("ifname",
+                                    "Interface name",
+                                    "The name of the I/K-bus network interface",
+                                    NULL, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  obj_properties[PROP_IO_THREAD] = g_param_spec_boolean ("io-thread",
+                                    "I/O thread",
+                                    "Serve the shared socket from a dedicated thread",
+                                    FALSE, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  obj_properties[PROP_TX_GAP] = g_param_spec_uint ("tx-gap",
+                                    "TX gap",
+                                    "Silence after each frame on the wire in us, 0 writes frames at once",
+                                    0, G_USEC_PER_SEC,
+                                    0, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_properties (object_class, N_PROP, obj_properties);
+}
+
+static void
+ikbus_mux_init (IKBusMux *mux)
+{
+  mux->priv = ikbus_mux_get_instance_private (mux);
+  mux->priv->route_list = g_array_new (FALSE, FALSE, sizeof (IKBusMuxRoute));
+}
+
+IKBusMux *
+ikbus_mux_new (gchar *ifname, GError **error)
+{
+  return IKBUS_MUX (g_initable_new (IKBUS_TYPE_MUX, NULL,
+                                    error, "ifname", ifname, NULL));
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IKBUSMUX_H_
+#define _IKBUSMUX_H_
+
+#include <glib-object.h>
+#include "ikbussocket.h"
+
+G_BEGIN_DECLS
+
+#define IKBUS_TYPE_MUX               (ikbus_mux_get_type())
+#define IKBUS_MUX(obj)               ((G_TYPE_CHECK_INSTANCE_CAST ((obj), IKBUS_TYPE_MUX, IKBusMux)))
+#define IKBUS_MUX_CLASS(klass)       ((G_TYPE_CHECK_CLASS_CAST ((klass), IKBUS_TYPE_MUX, IKBusMuxClass)))
+#define IKBUS_IS_MUX(obj)            ((G_TYPE_CHECK_INSTANCE_TYPE ((obj), IKBUS_TYPE_MUX)))
+#define IKBUS_IS_MUX_CLASS(klass)    ((G_TYPE_CHECK_CLASS_TYPE ((klass), IKBUS_TYPE_MUX)))
+#define IKBUS_MUX_GET_CLASS(obj)     ((G_TYPE_INSTANCE_GET_CLASS ((obj), IKBUS_TYPE_MUX, IKBusMuxClass)))
+
+typedef struct _IKBusMux        IKBusMux;
+typedef struct _IKBusMuxClass   IKBusMuxClass;
+typedef struct _IKBusMuxPrivate IKBusMuxPrivate;
+
+#define IKBUS_MUX_MAX_CLIENTS        32
+#define IKBUS_MUX_ANY                (-1)   /* Matches any sender or receiver */
+
+/* Frames are valid only for the duration of the call */
+typedef void (*IKBusMuxFunc) (const IKBusFrame *frame, gpointer user_data);
+
+struct _IKBusMux {
+  GObject parent_instance;
+  IKBusMuxPrivate *priv;
+};
+
+struct _IKBusMuxClass {
+  GObjectClass parent_class;
+};
+
+GType ikbus_mux_get_type (void);
+
+IKBusMux *ikbus_mux_new (gchar *ifname, GError **error);
+IKBusSocket *ikbus_mux_get_socket (IKBusMux *mux);
+gint ikbus_mux_add_client (IKBusMux *mux, IKBusMuxFunc func, gpointer user_data);
+void ikbus_mux_remove_client (IKBusMux *mux, gint client);
+gboolean ikbus_mux_route (IKBusMux *mux, gint client, gint sender, gint receiver);
+guint64 ikbus_mux_get_unrouted (IKBusMux *mux);
+guint64 ikbus_mux_get_drop_count (IKBusMux *mux, IKBusFrameStatus status);
+G_END_DECLS
+
+#endif /* _IKBUSMUX_H_ */
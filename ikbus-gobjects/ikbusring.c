@@ -0,0 +1,104 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include "ikbusring.h"
+
+#define RING_CACHE_LINE 64
+
+struct _IKBusRing
+{
+  /* Written by the consumer only */
+  volatile gint head;
+  guint8 pad_head[RING_CACHE_LINE - sizeof (gint)];
+
+  /* Written by the producer only */
+  volatile gint tail;
+  guint8 pad_tail[RING_CACHE_LINE - sizeof (gint)];
+
+  guint mask;                     /* Capacity - 1, capacity is a power of two */
+  gsize elem_size;
+  guint8 *elems;
+};
+
+IKBusRing *
+ikbus_ring_new (gsize elem_size, guint capacity)
+{
+  IKBusRing *ring;
+  guint size = 1;
+
+  g_return_val_if_fail (elem_size > 0 && capacity > 0, NULL);
+
+  while (size < capacity)
+    size <<= 1;
+
+  ring = g_new0 (IKBusRing, 1);
+  ring->mask = size - 1;
+  ring->elem_size = elem_size;
+  ring->elems = g_malloc0 (elem_size * size);
+
+  return ring;
+}
+
+void
+ikbus_ring_free (IKBusRing *ring)
+{
+  if (ring == NULL)
+    return;
+
+  g_free (ring->elems);
+  g_free (ring);
+}
+
+/* Producer: free slot to fill, or NULL if the ring is full */
+gpointer
+ikbus_ring_reserve (IKBusRing *ring)
+{
+  guint tail = ring->tail;
+
+  if (tail - (guint) g_atomic_int_get (&ring->head) > ring->mask)
+    return NULL;
+
+  return ring->elems + (tail & ring->mask) * ring->elem_size;
+}
+
+void
+ikbus_ring_commit (IKBusRing *ring)
+{
+  /* Full barrier: the slot contents are visible before the new tail */
+  g_atomic_int_set (&ring->tail, (gint) ((guint) ring->tail + 1));
+}
+
+/* Consumer: oldest element, or NULL if the ring is empty */
+gpointer
+ikbus_ring_peek (IKBusRing *ring)
+{
+  guint head = ring->head;
+
+  if (head == (guint) g_atomic_int_get (&ring->tail))
+    return NULL;
+
+  return ring->elems + (head & ring->mask) * ring->elem_size;
+}
+
+void
+ikbus_ring_release (IKBusRing *ring)
+{
+  g_atomic_int_set (&ring->head, (gint) ((guint) ring->head + 1));
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IKBUSRING_H_
+#define _IKBUSRING_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Lock-free ring of fixed-size elements for exactly one producer thread and
+ * one consumer thread. The producer fills the slot returned by
+ * ikbus_ring_reserve() and publishes it with ikbus_ring_commit(); the
+ * consumer reads ikbus_ring_peek() and frees the slot with
+ * ikbus_ring_release().
+ */
+typedef struct _IKBusRing IKBusRing;
+
+IKBusRing *ikbus_ring_new (gsize elem_size, guint capacity);
+void ikbus_ring_free (IKBusRing *ring);
+
+gpointer ikbus_ring_reserve (IKBusRing *ring);
+void ikbus_ring_commit (IKBusRing *ring);
+
+gpointer ikbus_ring_peek (IKBusRing *ring);
+void ikbus_ring_release (IKBusRing *ring);
+
+G_END_DECLS
+
+#endif /* _IKBUSRING_H_ */
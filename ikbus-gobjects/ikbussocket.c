@@ -17,15 +17,44 @@
  * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <gio/gio.h>
+#include <glib-unix.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <net/if.h>
 #include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <linux/serial.h>
+#include <linux/filter.h>
+#ifdef HAVE_IKBUS_HDRS
 #include <linux/ikbus.h>
+#endif
 #include "ikbussocket.h"
+#include "ikbusring.h"
+#include "ikbussync.h"
+
+#define IO_QUEUE_SIZE   64        /* Frames between the I/O thread and the main loop */
+#define IO_PRIORITY     10        /* SCHED_FIFO priority of the I/O thread */
+#define CAPTURE_RING_SIZE 4096    /* Frames buffered between capture flushes */
+#define CAPTURE_FLUSH   250       /* ms between capture flushes */
+#define FILTER_ACCEPT   0xffff    /* Return value of the socket filter for a wanted frame */
+#define BYTE_TIME       1146      /* us on the wire per byte at 9600 baud, 8E1 */
+#define TX_STALL        100       /* ms the rest of a frame may wait for the transmitter */
+#define TX_BATCH_MAX    (IKBUS_SOCKET_PRIO_LAST * IKBUS_SOCKET_TX_RING_SIZE)
+
+typedef struct _IKBusSocketTransport IKBusSocketTransport;
 
 typedef enum
 {
@@ -34,15 +63,111 @@ typedef enum
   STATE_CONNECTED
 } IKBusSocketState;
 
+/* Backend selected by the prefix of the interface name */
+struct _IKBusSocketTransport
+{
+  const gchar *prefix;
+  gint (*open) (IKBusSocket *sock, GError **error);
+  gboolean (*bind) (IKBusSocket *sock, IKBusSocketAddres addr,
+                    IKBusSocketAddres conn, GError **error);
+  gboolean soft_filter;           /* Emulate IKBUS_FILTER in userspace */
+  gboolean stream;                /* Byte stream framed by IKBusSync, checksum added on write */
+};
+
+/* Preformatted reply, published with a sequence lock for the I/O thread */
+typedef struct
+{
+  volatile gint seq;              /* Odd while being updated */
+  gboolean used;
+  guint8 cmd;
+  gint sub;                       /* First data byte or IKBUS_SOCKET_ANY_SUB */
+  gint nbytes;
+  guint8 data[IKBUS_MAX_FRAME_SIZE];
+} IKBusSocketAutoReply;
+
+/* Frame waiting in the capture ring */
+typedef struct
+{
+  gint64 time;                    /* Monotonic, us */
+  guint8 direction;               /* IKBUS_CAPTURE_RX or IKBUS_CAPTURE_TX */
+  guint8 nbytes;
+  guint8 data[IKBUS_MAX_FRAME_SIZE];
+} IKBusSocketCaptureRecord;
+
 struct _IKBusSocketPrivate
 {
+  const IKBusSocketTransport *transport;
   gchar *ifname;
   IKBusSocketAddres sock_addr;
   IKBusSocketAddres conn_addr;
   gint fd;
   IKBusSocketState state;
+
+  struct mmsghdr rx_msgs[IKBUS_SOCKET_BATCH_SIZE];
+  struct iovec rx_iovs[IKBUS_SOCKET_BATCH_SIZE];
+  IKBusSync *sync;                /* Frames of stream transports */
+
+  /* Frames wanted, none means all. Matched in userspace unless kernel_filter */
+  IKBusSocketSubscription subs[IKBUS_SOCKET_SUBSCRIPTIONS_MAX];
+  guint nsubs;
+  gboolean kernel_filter;         /* subs compiled to a socket filter */
+
+  /*
+   * Frames collected between ikbus_socket_tx_begin() and ikbus_socket_tx_end()
+   * or held back by pacing, one ring per priority
+   */
+  IKBusSocketFrame tx_ring[IKBUS_SOCKET_PRIO_LAST][IKBUS_SOCKET_TX_RING_SIZE];
+  guint tx_head[IKBUS_SOCKET_PRIO_LAST]; /* Oldest frame not yet sent */
+  guint tx_count[IKBUS_SOCKET_PRIO_LAST];/* Number of frames in tx_ring */
+  guint tx_total;                 /* Number of frames in all rings */
+  guint tx_hold;                  /* Nesting depth of ikbus_socket_tx_begin() */
+  guint tx_watch;                 /* Retries the flush when the socket was full */
+  IKBusSocketFrame *tx_batch[TX_BATCH_MAX]; /* Frames of one flush, in sending order */
+  struct mmsghdr tx_msgs[TX_BATCH_MAX];
+  struct iovec tx_iovs[TX_BATCH_MAX];
+
+  /* Pacing, see the "tx-gap" property */
+  guint tx_gap;                   /* us of silence after a frame, 0 to write at once */
+  gint64 tx_next;                 /* Monotonic time the bus is free again, us */
+
+  GQueue tx_sched;                /* Frames waiting for their deadline */
+  GSource *tx_source;             /* Drains tx_sched and paced frames from the main loop */
+
+  /* Dedicated I/O thread, see the "io-thread" property */
+  gboolean io_thread;
+  GThread *thread;
+  volatile gint io_stop;
+  volatile gint rx_error;         /* errno that stopped the I/O thread reading, 0 while it reads */
+  gint rx_event;                  /* Signals the main loop: frames in rx_queue */
+  gint tx_event;                  /* Signals the I/O thread: frames in tx_queue */
+  IKBusRing *rx_queue;            /* I/O thread -> main loop */
+  IKBusRing *tx_queue[IKBUS_SOCKET_PRIO_LAST]; /* Main loop -> I/O thread */
+  IKBusSocketAutoReply auto_replies[IKBUS_SOCKET_AUTO_REPLY_MAX];
+  IKBusSocketFrame io_reply;      /* Auto reply held back by pacing, goes out first */
+  gboolean io_reply_held;
+
+  volatile gint tx_last;          /* Monotonic time of the last frame sent, ms, wraps */
+
+  /*
+   * Capture, filled by whichever thread does the bus I/O and written out
+   * by a timer of the main loop.
+   */
+  volatile gint capture_on;
+  volatile gint capture_dropped;  /* Frames lost to a full ring */
+  IKBusRing *capture_ring;
+  FILE *capture_file;
+  gint64 capture_offset;          /* Real time minus monotonic time, us */
+  guint capture_id;
 };
 
+typedef struct
+{
+  gint64 ready_time;              /* Monotonic time, send no earlier than */
+  IKBusSocketPriority prio;
+  gint nbytes;
+  guint8 data[IKBUS_MAX_FRAME_SIZE];
+} IKBusSocketTxFrame;
+
 static void ikbus_socket_initable_iface_init (GInitableIface *iface);
 
 G_DEFINE_TYPE_WITH_CODE (IKBusSocket, ikbus_socket, G_TYPE_OBJECT,
@@ -54,15 +179,114 @@ enum
   PROP_IFNAME,
   PROP_SOCK_ADDR,
   PROP_CONN_ADDR,
+  PROP_IO_THREAD,
+  PROP_TX_GAP,
   N_PROP
 };
 
 static GParamSpec *obj_properties[N_PROP] = { NULL, };
 
+static void
+ikbus_socket_event_signal (gint fd)
+{
+  guint64 one = 1;
+
+  if (write (fd, &one, sizeof (one)) < 0)
+    return; /* Counter saturated, the reader is woken up anyway */
+}
+
+static void
+ikbus_socket_event_clear (gint fd)
+{
+  guint64 count;
+
+  if (read (fd, &count, sizeof (count)) < 0)
+    return; /* Nothing signalled */
+}
+
+/* Record a frame for the capture file, costs a copy into the ring */
+static inline void
+ikbus_socket_capture (IKBusSocketPrivate *priv, guint8 direction,
+                      const guint8 *buf, gint nbytes)
+{
+  IKBusSocketCaptureRecord *rec;
+
+  if (!g_atomic_int_get (&priv->capture_on))
+    return;
+
+  rec = ikbus_ring_reserve (priv->capture_ring);
+  if (rec == NULL)
+  {
+    g_atomic_int_inc (&priv->capture_dropped);
+    return;
+  }
+  rec->time = g_get_monotonic_time ();
+  rec->direction = direction;
+  rec->nbytes = MIN (nbytes, IKBUS_MAX_FRAME_SIZE);
+  memcpy (rec->data, buf, rec->nbytes);
+  ikbus_ring_commit (priv->capture_ring);
+}
+
+/* Remember when a frame last went out, see ikbus_socket_get_tx_idle() */
+static inline void
+ikbus_socket_tx_stamp (IKBusSocketPrivate *priv)
+{
+  g_atomic_int_set (&priv->tx_last, (gint) (guint) (g_get_monotonic_time () / 1000));
+}
+
+/* Keep the bus to the frame just written, its checksum included, and the gap */
+static inline void
+ikbus_socket_tx_pace (IKBusSocketPrivate *priv, gint nbytes)
+{
+  if (priv->tx_gap > 0)
+    priv->tx_next = g_get_monotonic_time () + (gint64) (nbytes + 1) * BYTE_TIME + priv->tx_gap;
+}
+
+/* Whether pacing holds frames back for now */
+static inline gboolean
+ikbus_socket_tx_paced (IKBusSocketPrivate *priv)
+{
+  return (priv->tx_gap > 0) && (g_get_monotonic_time () < priv->tx_next);
+}
+
 static void
 ikbus_socket_finalize (GObject *object)
 {
   IKBusSocket *sock = IKBUS_SOCKET (object);
+  guint i;
+
+  ikbus_socket_capture_stop (sock);
+  if (sock->priv->thread != NULL)
+  {
+    g_atomic_int_set (&sock->priv->io_stop, TRUE);
+    ikbus_socket_event_signal (sock->priv->tx_event);
+    g_thread_join (sock->priv->thread);
+  }
+  if (sock->priv->io_thread)
+  {
+    if (sock->priv->rx_event >= 0)
+      close (sock->priv->rx_event);
+    if (sock->priv->tx_event >= 0)
+      close (sock->priv->tx_event);
+    ikbus_ring_free (sock->priv->rx_queue);
+    for (i = 0; i < IKBUS_SOCKET_PRIO_LAST; i++)
+      ikbus_ring_free (sock->priv->tx_queue[i]);
+  }
+  ikbus_ring_free (sock->priv->capture_ring);
+
+  if (sock->priv->tx_watch != 0)
+    g_source_remove (sock->priv->tx_watch);
+  if (sock->priv->tx_source != NULL)
+  {
+    g_source_destroy (sock->priv->tx_source);
+    g_source_unref (sock->priv->tx_source);
+  }
+  g_queue_foreach (&sock->priv->tx_sched, (GFunc) g_free, NULL);
+  g_queue_clear (&sock->priv->tx_sched);
+
+  if (sock->priv->state >= STATE_SOCKET)
+    close (sock->priv->fd);
+  ikbus_sync_free (sock->priv->sync);
 
   g_free (sock->priv->ifname);
   G_OBJECT_CLASS (ikbus_socket_parent_class)->finalize (object);
@@ -81,6 +305,12 @@ ikbus_socket_get_property (GObject *object,
       case PROP_IFNAME:
         g_value_set_string (value, sock->priv->ifname);
         break;
+      case PROP_IO_THREAD:
+        g_value_set_boolean (value, sock->priv->io_thread);
+        break;
+      case PROP_TX_GAP:
+        g_value_set_uint (value, sock->priv->tx_gap);
+        break;
 
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -107,29 +337,44 @@ ikbus_socket_set_property (GObject *object,
       case PROP_CONN_ADDR:
         sock->priv->conn_addr = g_value_get_uchar (value);
         break;
+      case PROP_IO_THREAD:
+        sock->priv->io_thread = g_value_get_boolean (value);
+        break;
+      case PROP_TX_GAP:
+        sock->priv->tx_gap = g_value_get_uint (value);
+        break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
 }
 
-gboolean
-ikbus_socket_connect (IKBusSocket* sock,
-                      IKBusSocketAddres addr,
-                      IKBusSocketAddres conn,
-                      GError **error)
+#ifdef HAVE_IKBUS_HDRS
+static gint
+ikbus_socket_kernel_open (IKBusSocket *sock, GError **error)
 {
-  struct sockaddr_ikbus ikbus_addr;
-  struct ifreq ifr;
-  struct ikbus_filter filter;
-
-  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), FALSE);
+  gint sock_fd;
 
-  if (sock->priv->state != STATE_SOCKET)
+  sock_fd = socket (PF_IKBUS, SOCK_RAW, 0);
+  if (sock_fd < 0)
   {
-    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-                         "Unsuitable state of the I/K-bus socket");
-    return FALSE;
+    int errsv = errno;
+    g_set_error (error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (errsv),
+                 "Fail to create I/K-bus socket");
   }
+  return sock_fd;
+}
+
+static gboolean
+ikbus_socket_kernel_bind (IKBusSocket *sock,
+                          IKBusSocketAddres addr,
+                          IKBusSocketAddres conn,
+                          GError **error)
+{
+  struct sockaddr_ikbus ikbus_addr;
+  struct ifreq ifr;
+  struct ikbus_filter filter;
 
   /* Set up incoming filter */
     filter.id_rx = addr;
@@ -164,108 +409,1658 @@ ikbus_socket_connect (IKBusSocket* sock,
     return FALSE;
   }
 
-  sock->priv->state = STATE_CONNECTED;
-  sock->priv->sock_addr = addr;
-  sock->priv->conn_addr = conn;
   return TRUE;
 }
+#endif /* HAVE_IKBUS_HDRS */
 
-gint
-ikbus_socket_get_fd (IKBusSocket* sock)
+static gint
+ikbus_socket_unix_open (IKBusSocket *sock, GError **error)
 {
-  
-
-  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), -1);
+  gint sock_fd;
 
-  return sock->priv->fd;
+  sock_fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock_fd < 0)
+  {
+    int errsv = errno;
+    g_set_error (error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (errsv),
+                 "Fail to create userspace I/K-bus socket");
+  }
+  return sock_fd;
 }
 
-gint
-ikbus_socket_read (IKBusSocket *sock, guint8 *buf)
+/* "unix:PATH" connects to a simulated bus, '@' starts an abstract name */
+static gboolean
+ikbus_socket_unix_bind (IKBusSocket *sock,
+                        G_GNUC_UNUSED IKBusSocketAddres addr,
+                        G_GNUC_UNUSED IKBusSocketAddres conn,
+                        GError **error)
 {
-  gint ret = -1;
-  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), ret);
+  struct sockaddr_un un_addr;
+  const gchar *path = sock->priv->ifname + strlen ("unix:");
+  gsize len = strlen (path);
 
-  if (sock->priv->state == STATE_CONNECTED)
-    ret = read (sock->priv->fd, buf, IKBUS_MAX_FRAME_SIZE);
+  if ((len == 0) || (len >= sizeof (un_addr.sun_path)))
+  {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                 "Invalid simulated bus path %s", sock->priv->ifname);
+    return FALSE;
+  }
 
-  return ret;
+  memset (&un_addr, 0, sizeof (un_addr));
+  un_addr.sun_family = AF_UNIX;
+  memcpy (un_addr.sun_path, path, len);
+  if (path[0] == '@')
+    un_addr.sun_path[0] = '\0';
+
+  if (connect (sock->priv->fd, (struct sockaddr *) &un_addr,
+               offsetof (struct sockaddr_un, sun_path) + len) < 0)
+  {
+    int errsv = errno;
+    g_set_error (error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (errsv),
+                 "Error connecting to %s: %s", sock->priv->ifname, g_strerror (errsv));
+    return FALSE;
+  }
+
+  return TRUE;
 }
 
-gint
-ikbus_socket_write (IKBusSocket *sock, const guint8 *buf, gint nbytes)
+/*
+ * "fd:N" works on one end of a socketpair set up by the caller. The
+ * descriptor is duplicated, N stays owned by the caller.
+ */
+static gint
+ikbus_socket_fd_open (IKBusSocket *sock, GError **error)
 {
-  gint ret = -1;
-  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), ret);
+  gchar *end;
+  gint64 num;
+  gint fd;
 
-  if (sock->priv->state == STATE_CONNECTED)
-    ret = write (sock->priv->fd, buf, nbytes);
+  num = g_ascii_strtoll (sock->priv->ifname + strlen ("fd:"), &end, 10);
+  if ((*end != '\0') || (num < 0) || (num > G_MAXINT))
+  {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                 "Invalid file descriptor in %s", sock->priv->ifname);
+    return -1;
+  }
 
-  return ret;
+  fd = fcntl ((gint) num, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    int errsv = errno;
+    g_set_error (error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (errsv),
+                 "Fail to duplicate %s: %s", sock->priv->ifname, g_strerror (errsv));
+    return -1;
+  }
+  return fd;
 }
 
 static gboolean
-ikbus_socket_initable_init (GInitable *initable,
-                            GCancellable *cancellable,
-                            GError  **error)
+ikbus_socket_fd_bind (G_GNUC_UNUSED IKBusSocket *sock,
+                      G_GNUC_UNUSED IKBusSocketAddres addr,
+                      G_GNUC_UNUSED IKBusSocketAddres conn,
+                      G_GNUC_UNUSED GError **error)
 {
-  IKBusSocket *sock;
-  gint sock_fd;
+  return TRUE;
+}
 
-  g_return_val_if_fail (IKBUS_IS_SOCKET (initable), FALSE);
-  sock = IKBUS_SOCKET (initable);
+/*
+ * "tty:PATH" drives a serial I/K-bus transceiver: 9600 baud, 8 data bits,
+ * even parity, raw. Also works on the slave of a pseudo-terminal pair.
+ */
+static gint
+ikbus_socket_tty_open (IKBusSocket *sock, GError **error)
+{
+  const gchar *path = sock->priv->ifname + strlen ("tty:");
+  struct serial_struct serial;
+  struct termios tio;
+  gint fd;
 
-  if (sock->priv->state >= STATE_SOCKET)
-    return TRUE;
+  fd = open (path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+  {
+    int errsv = errno;
+    g_set_error (error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (errsv),
+                 "Fail to open %s: %s", path, g_strerror (errsv));
+    return -1;
+  }
 
-  sock_fd = socket (PF_IKBUS, SOCK_RAW, 0);
-  if (sock_fd < 0)
+  if (tcgetattr (fd, &tio) < 0)
   {
     int errsv = errno;
+    close (fd);
     g_set_error (error,
                  G_IO_ERROR,
                  g_io_error_from_errno (errsv),
-                 "Fail to create I/K-bus socket");
+                 "%s is not a terminal: %s", path, g_strerror (errsv));
+    return -1;
+  }
+  cfmakeraw (&tio);
+  cfsetispeed (&tio, B9600);
+  cfsetospeed (&tio, B9600);
+  tio.c_cflag &= ~(CSIZE | PARODD | CSTOPB | CRTSCTS);
+  tio.c_cflag |= CS8 | PARENB | CLOCAL | CREAD;
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  if (tcsetattr (fd, TCSANOW, &tio) < 0)
+  {
+    int errsv = errno;
+    close (fd);
+    g_set_error (error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (errsv),
+                 "Error setting up %s: %s", path, g_strerror (errsv));
+    return -1;
+  }
+  tcflush (fd, TCIOFLUSH);
+
+  /* Hand over every byte at once instead of after the driver's timer */
+  if (ioctl (fd, TIOCGSERIAL, &serial) == 0)
+  {
+    serial.flags |= ASYNC_LOW_LATENCY;
+    ioctl (fd, TIOCSSERIAL, &serial);
+  }
+
+  sock->priv->sync = ikbus_sync_new ();
+  return fd;
+}
+
+static const IKBusSocketTransport transports[] = {
+  { "unix:", ikbus_socket_unix_open, ikbus_socket_unix_bind, TRUE, FALSE },
+  { "fd:", ikbus_socket_fd_open, ikbus_socket_fd_bind, TRUE, FALSE },
+  { "tty:", ikbus_socket_tty_open, ikbus_socket_fd_bind, TRUE, TRUE },
+#ifdef HAVE_IKBUS_HDRS
+  { NULL, ikbus_socket_kernel_open, ikbus_socket_kernel_bind, FALSE, FALSE },
+#endif
+};
+
+static const IKBusSocketTransport *
+ikbus_socket_find_transport (const gchar *ifname)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (transports); i++)
+  {
+    if (transports[i].prefix == NULL)
+      return &transports[i];
+    if ((ifname != NULL) && g_str_has_prefix (ifname, transports[i].prefix))
+      return &transports[i];
+  }
+  return NULL;
+}
+
+/*
+ * Userspace counterpart of the kernel IKBUS_FILTER: id_rx selects the
+ * receiver and id_tx the sender of accepted frames, IKBUS_DEV_LOC in
+ * either field matches any address. Broadcasts to LOC and GLO reach
+ * every receiver.
+ */
+static inline gboolean
+ikbus_socket_bind_match (IKBusSocketPrivate *priv, const guint8 *buf, gint nbytes)
+{
+  if (!priv->transport->soft_filter)
+    return TRUE;
+  if (nbytes <= IKBUS_FRM_RECEIVER)
+    return FALSE;
+  if ((priv->sock_addr != IKBUS_DEV_LOC) && (buf[IKBUS_FRM_RECEIVER] != priv->sock_addr) &&
+      (buf[IKBUS_FRM_RECEIVER] != IKBUS_DEV_LOC) && (buf[IKBUS_FRM_RECEIVER] != IKBUS_DEV_GLO))
     return FALSE;
+  if ((priv->conn_addr != IKBUS_DEV_LOC) && (buf[IKBUS_FRM_SENDER] != priv->conn_addr))
+    return FALSE;
+  return TRUE;
+}
+
+/* Userspace counterpart of the subscription filter, see ikbus_socket_compile() */
+static gboolean
+ikbus_socket_subs_match (IKBusSocketPrivate *priv, const guint8 *buf, gint nbytes)
+{
+  const IKBusSocketSubscription *sub;
+  guint i;
+
+  for (i = 0; i < priv->nsubs; i++)
+  {
+    sub = &priv->subs[i];
+    if ((sub->sender != IKBUS_SOCKET_ANY) &&
+        ((nbytes <= IKBUS_FRM_SENDER) || (buf[IKBUS_FRM_SENDER] != sub->sender)))
+      continue;
+    if ((sub->receiver != IKBUS_SOCKET_ANY) &&
+        ((nbytes <= IKBUS_FRM_RECEIVER) || (buf[IKBUS_FRM_RECEIVER] != sub->receiver)))
+      continue;
+    if ((sub->cmd != IKBUS_SOCKET_ANY) &&
+        ((nbytes <= IKBUS_FRM_CMD) || (buf[IKBUS_FRM_CMD] != sub->cmd)))
+      continue;
+    return TRUE;
   }
 
-  sock->priv->fd = sock_fd;
-  sock->priv->state = STATE_SOCKET;
+  return FALSE;
+}
 
+static inline gboolean
+ikbus_socket_filter_match (IKBusSocketPrivate *priv, const guint8 *buf, gint nbytes)
+{
+  if (!ikbus_socket_bind_match (priv, buf, nbytes))
+    return FALSE;
+  if ((priv->nsubs > 0) && !priv->kernel_filter)
+    return ikbus_socket_subs_match (priv, buf, nbytes);
   return TRUE;
 }
 
-static void
-ikbus_socket_initable_iface_init (GInitableIface *iface)
+/* Take the complete frames out of the synchronizer, up to nframes */
+static gint
+ikbus_socket_stream_pop (IKBusSocketPrivate *priv, IKBusSocketFrame *frames, gint nframes)
 {
-  iface->init = ikbus_socket_initable_init;
+  gint n = 0, len;
+
+  while ((n < nframes) && ((len = ikbus_sync_pop (priv->sync, frames[n].data)) > 0))
+  {
+    if (!ikbus_socket_filter_match (priv, frames[n].data, len))
+      continue;
+    ikbus_socket_capture (priv, IKBUS_CAPTURE_RX, frames[n].data, len);
+    frames[n].flags = 0;
+    frames[n++].nbytes = len;
+  }
+
+  return n;
 }
 
-static void
-ikbus_socket_class_init (IKBusSocketClass *klass)
+/*
+ * Frame bytes read from a stream transport. A frame is at least
+ * IKBUS_SYNC_MIN_FRAME bytes, so reading no more than the frames still
+ * wanted can hold means no complete frame is left behind in the
+ * synchronizer; the rest waits in the tty and keeps the descriptor readable.
+ */
+static gint
+ikbus_socket_stream_recv (IKBusSocketPrivate *priv, IKBusSocketFrame *frames, gint nframes)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  guint8 buf[IKBUS_SOCKET_BATCH_SIZE * IKBUS_SYNC_MIN_FRAME];
+  gint n, want;
+  gssize len;
 
-  object_class->finalize = ikbus_socket_finalize;
-  object_class->get_property = ikbus_socket_get_property;
-  object_class->set_property = ikbus_socket_set_property;
+  n = ikbus_socket_stream_pop (priv, frames, nframes);
 
-  obj_properties[PROP_IFNAME] = g_param_spec_string ("ifname",
-                                    "Interface name",
-                                    "The name of the I/K-bus network interface",
-                                    NULL, /* default */
-                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+  if (n == nframes)
+    return n;
 
-  obj_properties[PROP_SOCK_ADDR] = g_param_spec_uchar ("sockaddr",
-                                    "Socket address",
-                                    "Socket address of the I/K-bus network",
-                                    0x00, 0xff, 0xff, /* default */
-                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+  /* At least the rest of the frame at the head, however long it is */
+  want = (nframes - n) * IKBUS_SYNC_MIN_FRAME - (gint) ikbus_sync_get_pending (priv->sync);
+  want = MAX (want, (gint) ikbus_sync_get_needed (priv->sync));
+  want = MIN (want, (gint) MIN (sizeof (buf), ikbus_sync_get_space (priv->sync)));
+  if (want <= 0)
+    return n;
 
-  obj_properties[PROP_CONN_ADDR] = g_param_spec_uchar ("connaddr",
-                                    "Connection address",
-                                    "Interlocutor address of the I/K-bus network",
-                                    0x00, 0xff, 0xff, /* default */
+  len = read (priv->fd, buf, want);
+  if (len < 0)
+    return ((n > 0) || (errno == EAGAIN) || (errno == EWOULDBLOCK)) ? n : -1;
+  if (len == 0)
+  {
+    /* End of file, stays readable so the frames popped go first */
+    if (n > 0)
+      return n;
+    errno = EPIPE;
+    return -1;
+  }
+
+  ikbus_sync_push (priv->sync, buf, len);
+  return n + ikbus_socket_stream_pop (priv, frames + n, nframes - n);
+}
+
+/*
+ * Write one frame, stream transports put the checksum on the wire too. Once
+ * part of a frame is written the rest follows, waiting for the transmitter
+ * if need be, so no frame is cut short on the bus.
+ */
+static gssize
+ikbus_socket_send (IKBusSocketPrivate *priv, const guint8 *buf, gint nbytes)
+{
+  guint8 frame[IKBUS_MAX_FRAME_SIZE + 1];
+  struct pollfd pfd;
+  gssize ret;
+  gint i, done = 0;
+
+  if (!priv->transport->stream)
+    return write (priv->fd, buf, nbytes);
+
+  if ((nbytes <= 0) || (nbytes > IKBUS_MAX_FRAME_SIZE - 1))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memcpy (frame, buf, nbytes);
+  frame[nbytes] = 0;
+  for (i = 0; i < nbytes; i++)
+    frame[nbytes] ^= buf[i];
+
+  while (done < nbytes + 1)
+  {
+    ret = write (priv->fd, frame + done, nbytes + 1 - done);
+    if (ret >= 0)
+    {
+      done += ret;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if ((done == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+      return -1;
+
+    pfd.fd = priv->fd;
+    pfd.events = POLLOUT;
+    ret = poll (&pfd, 1, (nbytes + 1 - done) * BYTE_TIME / 1000 + TX_STALL);
+    if (ret == 0)
+      errno = ETIMEDOUT;
+    if ((ret <= 0) && (errno != EINTR))
+      return -1;
+  }
+
+  return nbytes;
+}
+
+/*
+ * Receive pending frames that pass the filter, without blocking. At end of
+ * file, a hung-up peer, returns -1 with errno EPIPE.
+ */
+static gint
+ikbus_socket_recv_batch (IKBusSocketPrivate *priv, struct mmsghdr *msgs,
+                         struct iovec *iovs, IKBusSocketFrame *frames, gint nframes)
+{
+  gint ret, i, n;
+
+  if (priv->transport->stream)
+    return ikbus_socket_stream_recv (priv, frames, nframes);
+
+  for (i = 0; i < nframes; i++)
+  {
+    iovs[i].iov_base = frames[i].data;
+    iovs[i].iov_len = IKBUS_MAX_FRAME_SIZE;
+    memset (&msgs[i].msg_hdr, 0, sizeof (struct msghdr));
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  ret = recvmmsg (priv->fd, msgs, nframes, MSG_DONTWAIT, NULL);
+  if (ret < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+  /* Only empty messages is end of file, there are no empty frames */
+  for (i = 0; (i < ret) && (msgs[i].msg_len == 0); i++)
+    ;
+  if ((ret > 0) && (i == ret))
+  {
+    errno = EPIPE;
+    return -1;
+  }
+
+  n = 0;
+  for (i = 0; i < ret; i++)
+  {
+    if (!ikbus_socket_filter_match (priv, frames[i].data, msgs[i].msg_len))
+      continue;
+    ikbus_socket_capture (priv, IKBUS_CAPTURE_RX, frames[i].data, msgs[i].msg_len);
+    if (n != i)
+      memcpy (frames[n].data, frames[i].data, msgs[i].msg_len);
+    frames[n].flags = 0;
+    frames[n++].nbytes = msgs[i].msg_len;
+  }
+
+  return n;
+}
+
+/* Write a frame from the I/O thread and account for it */
+static gboolean
+ikbus_socket_io_write (IKBusSocketPrivate *priv, const guint8 *buf, gint nbytes)
+{
+  if (ikbus_socket_send (priv, buf, nbytes) < 0)
+    return FALSE;
+  ikbus_socket_tx_stamp (priv);
+  ikbus_socket_tx_pace (priv, nbytes);
+  ikbus_socket_capture (priv, IKBUS_CAPTURE_TX, buf, nbytes);
+  return TRUE;
+}
+
+/*
+ * Answer frame from the published replies. Runs on the I/O thread, the
+ * sequence lock guarantees a consistent copy of the reply. A reply that is
+ * being updated is not waited for, the main loop answers the frame instead.
+ * While pacing holds the bus the reply waits in io_reply, ahead of every
+ * queued frame; one already waiting leaves the frame to the main loop too.
+ */
+static gboolean
+ikbus_socket_auto_reply (IKBusSocketPrivate *priv, const IKBusSocketFrame *frame)
+{
+  IKBusSocketAutoReply *reply;
+  guint8 buf[IKBUS_MAX_FRAME_SIZE];
+  gint sub, seq, nbytes, i;
+  guint8 receiver;
+  gboolean match;
+
+  if (frame->nbytes <= IKBUS_FRM_CMD)
+    return FALSE;
+  sub = (frame->nbytes > IKBUS_FRM_CMD + 1) ? frame->data[IKBUS_FRM_CMD + 1] : -2;
+  /* Only polls of the replying device, a shared socket sees them all */
+  receiver = frame->data[IKBUS_FRM_RECEIVER];
+
+  for (i = 0; i < IKBUS_SOCKET_AUTO_REPLY_MAX; i++)
+  {
+    reply = &priv->auto_replies[i];
+    for (;;)
+    {
+      seq = g_atomic_int_get (&reply->seq);
+      if (seq & 1)
+        return FALSE;
+      match = reply->used && (reply->cmd == frame->data[IKBUS_FRM_CMD]) &&
+              ((reply->sub == IKBUS_SOCKET_ANY_SUB) || (reply->sub == sub)) &&
+              ((receiver == reply->data[IKBUS_FRM_SENDER]) ||
+               (receiver == IKBUS_DEV_LOC) || (receiver == IKBUS_DEV_GLO));
+      nbytes = reply->nbytes;
+      if (match)
+        memcpy (buf, reply->data, nbytes);
+      /* Keep the reads of the reply before the second read of seq */
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (g_atomic_int_get (&reply->seq) == seq)
+        break;
+    }
+
+    if (match)
+    {
+      if (!ikbus_socket_tx_paced (priv))
+        return ikbus_socket_io_write (priv, buf, nbytes);
+      if (priv->io_reply_held)
+        return FALSE;
+      memcpy (priv->io_reply.data, buf, nbytes);
+      priv->io_reply.nbytes = nbytes;
+      priv->io_reply_held = TRUE;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/* Next frame queued by the main loop, highest priority first */
+static IKBusSocketFrame *
+ikbus_socket_io_peek (IKBusSocketPrivate *priv, IKBusRing **queue)
+{
+  IKBusSocketFrame *frame;
+  guint i;
+
+  for (i = 0; i < IKBUS_SOCKET_PRIO_LAST; i++)
+    if ((frame = ikbus_ring_peek (priv->tx_queue[i])) != NULL)
+    {
+      *queue = priv->tx_queue[i];
+      return frame;
+    }
+
+  return NULL;
+}
+
+/*
+ * Write the held auto reply, then the frames queued by the main loop, as far
+ * as pacing allows
+ */
+static void
+ikbus_socket_io_send (IKBusSocketPrivate *priv)
+{
+  IKBusSocketFrame *frame;
+  IKBusRing *queue;
+
+  if (priv->io_reply_held)
+  {
+    if (ikbus_socket_tx_paced (priv))
+      return;
+    if (!ikbus_socket_io_write (priv, priv->io_reply.data, priv->io_reply.nbytes))
+      g_debug ("I/O thread: error writing reply: %s", g_strerror (errno));
+    priv->io_reply_held = FALSE;
+  }
+
+  while ((frame = ikbus_socket_io_peek (priv, &queue)) != NULL)
+  {
+    if (ikbus_socket_tx_paced (priv))
+      break;
+    if (!ikbus_socket_io_write (priv, frame->data, frame->nbytes))
+      g_debug ("I/O thread: error writing frame: %s", g_strerror (errno));
+    ikbus_ring_release (queue);
+  }
+}
+
+static gpointer
+ikbus_socket_io_thread (gpointer data)
+{
+  IKBusSocketPrivate *priv = IKBUS_SOCKET (data)->priv;
+  IKBusSocketFrame frames[IKBUS_SOCKET_BATCH_SIZE];
+  struct mmsghdr msgs[IKBUS_SOCKET_BATCH_SIZE];
+  struct iovec iovs[IKBUS_SOCKET_BATCH_SIZE];
+  struct sched_param param;
+  struct pollfd fds[2];
+  IKBusSocketFrame *slot;
+  IKBusRing *queue;
+  gint i, n, pushed, timeout;
+
+  /* Best effort, real-time scheduling needs CAP_SYS_NICE */
+  memset (&param, 0, sizeof (param));
+  param.sched_priority = IO_PRIORITY;
+  pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+
+  fds[0].fd = priv->fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = priv->tx_event;
+  fds[1].events = POLLIN;
+
+  while (!g_atomic_int_get (&priv->io_stop))
+  {
+    /* Wake up when pacing lets the next frame go */
+    timeout = -1;
+    if ((priv->tx_gap > 0) &&
+        (priv->io_reply_held || (ikbus_socket_io_peek (priv, &queue) != NULL)))
+      timeout = MAX ((priv->tx_next - g_get_monotonic_time () + 999) / 1000, 0);
+
+    if (poll (fds, 2, timeout) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (fds[1].revents & POLLIN)
+      ikbus_socket_event_clear (priv->tx_event);
+    ikbus_socket_io_send (priv);
+
+    if (!(fds[0].revents & (POLLIN | POLLERR | POLLHUP)))
+      continue;
+
+    /* A hang-up with nothing left to read is end of file too */
+    if (fds[0].revents & POLLIN)
+      n = ikbus_socket_recv_batch (priv, msgs, iovs, frames, IKBUS_SOCKET_BATCH_SIZE);
+    else
+    {
+      n = -1;
+      errno = (fds[0].revents & POLLERR) ? EIO : EPIPE;
+    }
+
+    /* Stop polling the dead descriptor and let the main loop know */
+    if (n < 0)
+    {
+      g_atomic_int_set (&priv->rx_error, errno);
+      fds[0].fd = -1;
+      ikbus_socket_event_signal (priv->rx_event);
+      continue;
+    }
+
+    pushed = 0;
+    for (i = 0; i < n; i++)
+    {
+      if (ikbus_socket_auto_reply (priv, &frames[i]))
+        frames[i].flags |= IKBUS_SOCKET_FRAME_ANSWERED;
+
+      /* If the main loop does not keep up the frame is lost, pollers repeat */
+      slot = ikbus_ring_reserve (priv->rx_queue);
+      if (slot == NULL)
+        continue;
+      memcpy (slot, &frames[i], sizeof (IKBusSocketFrame));
+      ikbus_ring_commit (priv->rx_queue);
+      pushed++;
+    }
+    if (pushed > 0)
+      ikbus_socket_event_signal (priv->rx_event);
+  }
+
+  return NULL;
+}
+
+/* Hand a frame over to the I/O thread */
+static gint
+ikbus_socket_io_queue (IKBusSocketPrivate *priv, IKBusSocketPriority prio,
+                       const guint8 *buf, gint nbytes)
+{
+  IKBusSocketFrame *slot;
+
+  slot = ikbus_ring_reserve (priv->tx_queue[prio]);
+  if (slot == NULL)
+  {
+    errno = ENOBUFS;
+    return -1;
+  }
+  slot->nbytes = nbytes;
+  slot->flags = 0;
+  memcpy (slot->data, buf, nbytes);
+  ikbus_ring_commit (priv->tx_queue[prio]);
+
+  if (priv->tx_hold == 0)
+    ikbus_socket_event_signal (priv->tx_event);
+
+  return nbytes;
+}
+
+/*
+ * Publish a reply the I/O thread sends as soon as a frame with command cmd
+ * (and first data byte sub, unless IKBUS_SOCKET_ANY_SUB) arrives for the
+ * sender of the reply, before the frame reaches the main loop. Calling it
+ * again for the same sender, cmd and sub replaces the reply, so devices
+ * sharing the socket keep their own. Without the I/O thread this does nothing.
+ */
+gboolean
+ikbus_socket_set_auto_reply (IKBusSocket *sock, guint8 cmd, gint sub,
+                             const guint8 *reply, gint nbytes)
+{
+  IKBusSocketAutoReply *slot = NULL;
+  guint i;
+
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), FALSE);
+  g_return_val_if_fail (nbytes > 0 && nbytes <= IKBUS_MAX_FRAME_SIZE, FALSE);
+
+  if (!sock->priv->io_thread)
+    return FALSE;
+
+  for (i = 0; i < IKBUS_SOCKET_AUTO_REPLY_MAX; i++)
+  {
+    IKBusSocketAutoReply *r = &sock->priv->auto_replies[i];
+
+    if (r->used && (r->data[IKBUS_FRM_SENDER] == reply[IKBUS_FRM_SENDER]) &&
+        (r->cmd == cmd) && (r->sub == sub))
+    {
+      slot = r;
+      break;
+    }
+    if (!r->used && (slot == NULL))
+      slot = r;
+  }
+  if (slot == NULL)
+    return FALSE;
+
+  g_atomic_int_inc (&slot->seq);
+  slot->cmd = cmd;
+  slot->sub = sub;
+  slot->nbytes = nbytes;
+  memcpy (slot->data, reply, nbytes);
+  slot->used = TRUE;
+  g_atomic_int_inc (&slot->seq);
+
+  return TRUE;
+}
+
+/* Withdraw the reply device sender published for cmd and sub, if there is one */
+void
+ikbus_socket_clear_auto_reply (IKBusSocket *sock, IKBusSocketAddres sender,
+                               guint8 cmd, gint sub)
+{
+  IKBusSocketAutoReply *r;
+  guint i;
+
+  g_return_if_fail (IKBUS_IS_SOCKET (sock));
+
+  for (i = 0; i < IKBUS_SOCKET_AUTO_REPLY_MAX; i++)
+  {
+    r = &sock->priv->auto_replies[i];
+    if (r->used && (r->data[IKBUS_FRM_SENDER] == sender) &&
+        (r->cmd == cmd) && (r->sub == sub))
+    {
+      g_atomic_int_inc (&r->seq);
+      r->used = FALSE;
+      g_atomic_int_inc (&r->seq);
+    }
+  }
+}
+
+/*
+ * Classic BPF program accepting the frames of any subscription. Each
+ * subscription is a run of byte compares, a mismatch jumps to the next
+ * one. The kernel drops frames too short for a compared byte.
+ */
+static guint
+ikbus_socket_compile (const IKBusSocketSubscription *subs, guint nsubs,
+                      struct sock_filter *prog)
+{
+  static const guint offsets[3] = { IKBUS_FRM_SENDER, IKBUS_FRM_RECEIVER, IKBUS_FRM_CMD };
+  gint fields[3];
+  guint i, j, n = 0, left;
+
+  for (i = 0; i < nsubs; i++)
+  {
+    fields[0] = subs[i].sender;
+    fields[1] = subs[i].receiver;
+    fields[2] = subs[i].cmd;
+
+    left = 0;
+    for (j = 0; j < 3; j++)
+      if (fields[j] != IKBUS_SOCKET_ANY)
+        left += 2;
+
+    for (j = 0; j < 3; j++)
+    {
+      if (fields[j] == IKBUS_SOCKET_ANY)
+        continue;
+      left -= 2;
+      prog[n++] = (struct sock_filter) BPF_STMT (BPF_LD | BPF_B | BPF_ABS, offsets[j]);
+      prog[n++] = (struct sock_filter) BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, fields[j],
+                                                 0, left + 1);
+    }
+    prog[n++] = (struct sock_filter) BPF_STMT (BPF_RET | BPF_K, FILTER_ACCEPT);
+  }
+  prog[n++] = (struct sock_filter) BPF_STMT (BPF_RET | BPF_K, 0);
+
+  return n;
+}
+
+/**
+ * ikbus_socket_set_subscriptions:
+ * Receive only the frames matching one of subs, on top of the addresses
+ * given to ikbus_socket_connect(). The set replaces the previous one, an
+ * empty set receives everything again.
+ *
+ * The set is attached to the socket as a filter, so the kernel drops
+ * unwanted frames before they wake the process. Transports that cannot
+ * take a filter match in userspace instead; that is not possible while the
+ * I/O thread runs.
+ */
+gboolean
+ikbus_socket_set_subscriptions (IKBusSocket *sock, const IKBusSocketSubscription *subs,
+                                guint nsubs, GError **error)
+{
+  IKBusSocketPrivate *priv;
+  struct sock_filter prog[IKBUS_SOCKET_SUBSCRIPTIONS_MAX * 7 + 1];
+  struct sock_fprog fprog;
+  gboolean kernel = FALSE;
+  guint i;
+
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), FALSE);
+  g_return_val_if_fail ((nsubs == 0) || (subs != NULL), FALSE);
+
+  priv = sock->priv;
+  if (nsubs > IKBUS_SOCKET_SUBSCRIPTIONS_MAX)
+  {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                 "At most %d subscriptions", IKBUS_SOCKET_SUBSCRIPTIONS_MAX);
+    return FALSE;
+  }
+  for (i = 0; i < nsubs; i++)
+    if ((subs[i].sender < IKBUS_SOCKET_ANY) || (subs[i].sender > 0xff) ||
+        (subs[i].receiver < IKBUS_SOCKET_ANY) || (subs[i].receiver > 0xff) ||
+        (subs[i].cmd < IKBUS_SOCKET_ANY) || (subs[i].cmd > 0xff))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Subscription %u out of range", i);
+      return FALSE;
+    }
+
+  /* The I/O thread reads the userspace set without a lock */
+  if ((priv->thread != NULL) && (priv->nsubs > 0) && !priv->kernel_filter)
+  {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_BUSY,
+                         "Subscriptions are filtered by the I/O thread");
+    return FALSE;
+  }
+
+  if (nsubs > 0)
+  {
+    fprog.len = ikbus_socket_compile (subs, nsubs, prog);
+    fprog.filter = prog;
+    kernel = (setsockopt (priv->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof (fprog)) == 0);
+    if (!kernel)
+      g_debug ("No socket filter on %s: %s", priv->ifname, g_strerror (errno));
+  }
+
+  if ((nsubs > 0) && !kernel && (priv->thread != NULL))
+  {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                 "No socket filter on %s, subscriptions need to be set before connecting",
+                 priv->ifname);
+    return FALSE;
+  }
+
+  /* Whatever is left in the kernel would filter on the old set */
+  if (!kernel && priv->kernel_filter)
+    setsockopt (priv->fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+
+  priv->nsubs = 0;
+  priv->kernel_filter = kernel;
+  if (nsubs > 0)
+    memcpy (priv->subs, subs, nsubs * sizeof (IKBusSocketSubscription));
+  priv->nsubs = nsubs;
+
+  return TRUE;
+}
+
+/* Whether the subscriptions are matched by the kernel */
+gboolean
+ikbus_socket_get_kernel_filter (IKBusSocket *sock)
+{
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), FALSE);
+
+  return sock->priv->kernel_filter;
+}
+
+gboolean
+ikbus_socket_connect (IKBusSocket* sock,
+                      IKBusSocketAddres addr,
+                      IKBusSocketAddres conn,
+                      GError **error)
+{
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), FALSE);
+
+  if (sock->priv->state != STATE_SOCKET)
+  {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                         "Unsuitable state of the I/K-bus socket");
+    return FALSE;
+  }
+
+  if (!sock->priv->transport->bind (sock, addr, conn, error))
+    return FALSE;
+
+  sock->priv->state = STATE_CONNECTED;
+  sock->priv->sock_addr = addr;
+  sock->priv->conn_addr = conn;
+
+  if (sock->priv->io_thread)
+  {
+    sock->priv->thread = g_thread_try_new ("ikbus-io", ikbus_socket_io_thread, sock, error);
+    if (sock->priv->thread == NULL)
+    {
+      sock->priv->state = STATE_SOCKET;
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/*
+ * Descriptor to poll for incoming frames. With the I/O thread this is the
+ * event the thread raises, not the bus socket itself.
+ */
+gint
+ikbus_socket_get_fd (IKBusSocket* sock)
+{
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), -1);
+
+  return sock->priv->io_thread ? sock->priv->rx_event : sock->priv->fd;
+}
+
+gint
+ikbus_socket_read (IKBusSocket *sock, guint8 *buf)
+{
+  IKBusSocketFrame frame;
+  gint ret = -1;
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), ret);
+
+  if (sock->priv->state != STATE_CONNECTED)
+    return ret;
+
+  if (sock->priv->io_thread)
+  {
+    ret = ikbus_socket_read_batch (sock, &frame, 1);
+    if (ret > 0)
+    {
+      memcpy (buf, frame.data, frame.nbytes);
+      ret = frame.nbytes;
+    }
+    return ret;
+  }
+
+  if (sock->priv->transport->stream)
+  {
+    ret = ikbus_socket_stream_recv (sock->priv, &frame, 1);
+    if (ret > 0)
+    {
+      memcpy (buf, frame.data, frame.nbytes);
+      ret = frame.nbytes;
+    }
+    return ret;
+  }
+
+  ret = read (sock->priv->fd, buf, IKBUS_MAX_FRAME_SIZE);
+  if (ret == 0)
+  {
+    errno = EPIPE;
+    return -1;
+  }
+  if ((ret > 0) && !ikbus_socket_filter_match (sock->priv, buf, ret))
+    ret = 0;
+  if (ret > 0)
+    ikbus_socket_capture (sock->priv, IKBUS_CAPTURE_RX, buf, ret);
+
+  return ret;
+}
+
+/*
+ * Read all frames already queued on the socket, up to nframes, with a single
+ * system call. Returns the number of frames stored, 0 if nothing was pending
+ * or -1 on error. Once the peer hung up it returns -1 with errno EPIPE; the
+ * descriptor stays readable, so the watch calling this has to be removed.
+ */
+gint
+ikbus_socket_read_batch (IKBusSocket *sock, IKBusSocketFrame *frames, gint nframes)
+{
+  IKBusSocketPrivate *priv;
+  IKBusSocketFrame *slot;
+  gint n = 0;
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), -1);
+
+  priv = sock->priv;
+  if (priv->state != STATE_CONNECTED)
+    return -1;
+
+  if (nframes > IKBUS_SOCKET_BATCH_SIZE)
+    nframes = IKBUS_SOCKET_BATCH_SIZE;
+
+  if (!priv->io_thread)
+    return ikbus_socket_recv_batch (priv, priv->rx_msgs, priv->rx_iovs, frames, nframes);
+
+  /* Clear the event first, frames queued after this raise it again */
+  ikbus_socket_event_clear (priv->rx_event);
+  while ((n < nframes) && ((slot = ikbus_ring_peek (priv->rx_queue)) != NULL))
+  {
+    memcpy (&frames[n++], slot, sizeof (IKBusSocketFrame));
+    ikbus_ring_release (priv->rx_queue);
+  }
+  if (ikbus_ring_peek (priv->rx_queue) != NULL)
+    ikbus_socket_event_signal (priv->rx_event);
+
+  /* The I/O thread stopped reading, report it once its frames are taken */
+  if ((n == 0) && (g_atomic_int_get (&priv->rx_error) != 0))
+  {
+    errno = g_atomic_int_get (&priv->rx_error);
+    return -1;
+  }
+
+  return n;
+}
+
+static gboolean ikbus_socket_tx_flush (IKBusSocket *sock, GError **error);
+static void ikbus_socket_tx_rearm (IKBusSocket *sock);
+
+static gboolean
+ikbus_socket_tx_ready (G_GNUC_UNUSED gint fd,
+                       G_GNUC_UNUSED GIOCondition condition,
+                       gpointer data)
+{
+  IKBusSocket *sock = IKBUS_SOCKET (data);
+  GError *error = NULL;
+
+  if (!ikbus_socket_tx_flush (sock, &error))
+  {
+    g_warning ("%s\n", error->message);
+    g_clear_error (&error);
+  }
+
+  if ((sock->priv->tx_total > 0) && !ikbus_socket_tx_paced (sock->priv))
+    return G_SOURCE_CONTINUE;
+
+  sock->priv->tx_watch = 0;
+  ikbus_socket_tx_rearm (sock);
+  return G_SOURCE_REMOVE;
+}
+
+/* sendmmsg() for stream transports: frames written, or -1 if the first failed */
+static gint
+ikbus_socket_stream_sendmmsg (IKBusSocketPrivate *priv, guint n)
+{
+  IKBusSocketFrame *frame;
+  guint i;
+
+  for (i = 0; i < n; i++)
+  {
+    frame = priv->tx_batch[i];
+    if (ikbus_socket_send (priv, frame->data, frame->nbytes) < 0)
+      return (i > 0) ? (gint) i : -1;
+  }
+
+  return i;
+}
+
+/* Line up the queued frames, highest priority first, in tx_batch */
+static guint
+ikbus_socket_tx_collect (IKBusSocketPrivate *priv)
+{
+  guint prio, i, n = 0;
+
+  for (prio = 0; prio < IKBUS_SOCKET_PRIO_LAST; prio++)
+    for (i = 0; i < priv->tx_count[prio]; i++)
+      priv->tx_batch[n++] =
+        &priv->tx_ring[prio][(priv->tx_head[prio] + i) % IKBUS_SOCKET_TX_RING_SIZE];
+
+  return n;
+}
+
+/* Drop the first n frames of tx_batch from the rings */
+static void
+ikbus_socket_tx_consume (IKBusSocketPrivate *priv, guint n)
+{
+  guint prio = 0, take;
+
+  while (n > 0)
+  {
+    while (priv->tx_count[prio] == 0)
+      prio++;
+    take = MIN (n, priv->tx_count[prio]);
+    priv->tx_head[prio] = (priv->tx_head[prio] + take) % IKBUS_SOCKET_TX_RING_SIZE;
+    priv->tx_count[prio] -= take;
+    priv->tx_total -= take;
+    n -= take;
+  }
+}
+
+/*
+ * Send the TX rings with as few sendmmsg calls as possible, highest priority
+ * first. A frame rejected by the socket is dropped and reported, the rest
+ * are still sent. If the socket is full the remaining frames stay queued
+ * until it becomes writable. With pacing one frame goes at a time, the
+ * others wait for the tx source.
+ */
+static gboolean
+ikbus_socket_tx_flush (IKBusSocket *sock, GError **error)
+{
+  IKBusSocketPrivate *priv = sock->priv;
+  IKBusSocketFrame *frame;
+  GError *first_error = NULL;
+  guint i, n;
+  gint ret;
+
+  while (priv->tx_total > 0)
+  {
+    if (ikbus_socket_tx_paced (priv))
+      break;
+
+    n = ikbus_socket_tx_collect (priv);
+    if (priv->tx_gap > 0)
+      n = 1;
+    for (i = 0; i < n; i++)
+    {
+      priv->tx_iovs[i].iov_base = priv->tx_batch[i]->data;
+      priv->tx_iovs[i].iov_len = priv->tx_batch[i]->nbytes;
+      memset (&priv->tx_msgs[i].msg_hdr, 0, sizeof (struct msghdr));
+      priv->tx_msgs[i].msg_hdr.msg_iov = &priv->tx_iovs[i];
+      priv->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if (priv->transport->stream)
+      ret = ikbus_socket_stream_sendmmsg (priv, n);
+    else
+      ret = sendmmsg (priv->fd, priv->tx_msgs, n, MSG_DONTWAIT);
+    if (ret < 0)
+    {
+      int errsv = errno;
+
+      if (errsv == EINTR)
+        continue;
+
+      if ((errsv == EAGAIN) || (errsv == EWOULDBLOCK))
+      {
+        if (priv->tx_watch == 0)
+          priv->tx_watch = g_unix_fd_add (priv->fd, G_IO_OUT,
+                                          ikbus_socket_tx_ready, sock);
+        break;
+      }
+
+      /* sendmmsg() reports the error of the first frame it could not send */
+      frame = priv->tx_batch[0];
+      if (first_error == NULL)
+        g_set_error (&first_error,
+                     G_IO_ERROR,
+                     g_io_error_from_errno (errsv),
+                     "Error writing frame 0x%02X->0x%02X (0x%02X): %s",
+                     frame->data[0], frame->data[2], frame->data[3],
+                     g_strerror (errsv));
+      else
+        g_warning ("Error writing frame 0x%02X->0x%02X (0x%02X): %s\n",
+                   frame->data[0], frame->data[2], frame->data[3],
+                   g_strerror (errsv));
+      ret = 1;
+    }
+    else
+    {
+      ikbus_socket_tx_stamp (priv);
+      ikbus_socket_tx_pace (priv, priv->tx_batch[0]->nbytes);
+      for (i = 0; i < (guint) ret; i++)
+      {
+        frame = priv->tx_batch[i];
+        ikbus_socket_capture (priv, IKBUS_CAPTURE_TX, frame->data, frame->nbytes);
+      }
+    }
+
+    ikbus_socket_tx_consume (priv, ret);
+  }
+
+  /* Frames held back by pacing */
+  if (priv->tx_gap > 0)
+    ikbus_socket_tx_rearm (sock);
+
+  if (first_error != NULL)
+  {
+    g_propagate_error (error, first_error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Collect written frames in the TX rings until the matching
+ * ikbus_socket_tx_end(). Calls may be nested.
+ */
+void
+ikbus_socket_tx_begin (IKBusSocket *sock)
+{
+  g_return_if_fail (IKBUS_IS_SOCKET (sock));
+
+  sock->priv->tx_hold++;
+}
+
+gboolean
+ikbus_socket_tx_end (IKBusSocket *sock, GError **error)
+{
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), FALSE);
+  g_return_val_if_fail (sock->priv->tx_hold > 0, FALSE);
+
+  if (--sock->priv->tx_hold > 0)
+    return TRUE;
+
+  if (sock->priv->io_thread)
+  {
+    ikbus_socket_event_signal (sock->priv->tx_event);
+    return TRUE;
+  }
+
+  /* A pending retry will send the rest in order */
+  if (sock->priv->tx_watch != 0)
+    return TRUE;
+
+  return ikbus_socket_tx_flush (sock, error);
+}
+
+/* Queue a frame for the TX rings or the I/O thread */
+static gint
+ikbus_socket_tx_queue (IKBusSocket *sock, const guint8 *buf, gint nbytes,
+                       IKBusSocketPriority prio)
+{
+  IKBusSocketPrivate *priv = sock->priv;
+  IKBusSocketFrame *frame;
+  gint ret = -1;
+
+  /* Write straight away unless batching, behind queued frames or paced */
+  if (!priv->io_thread && (priv->tx_hold == 0) && (priv->tx_total == 0) &&
+      !ikbus_socket_tx_paced (priv))
+  {
+    ret = ikbus_socket_send (priv, buf, nbytes);
+    if (ret > 0)
+    {
+      ikbus_socket_tx_stamp (priv);
+      ikbus_socket_tx_pace (priv, nbytes);
+      ikbus_socket_capture (priv, IKBUS_CAPTURE_TX, buf, nbytes);
+    }
+    return ret;
+  }
+
+  if ((nbytes <= 0) || (nbytes > IKBUS_MAX_FRAME_SIZE))
+  {
+    errno = EINVAL;
+    return ret;
+  }
+
+  if (priv->io_thread)
+    return ikbus_socket_io_queue (priv, prio, buf, nbytes);
+
+  if ((priv->tx_count[prio] == IKBUS_SOCKET_TX_RING_SIZE) && (priv->tx_watch == 0))
+    ikbus_socket_tx_flush (sock, NULL);
+
+  if (priv->tx_count[prio] == IKBUS_SOCKET_TX_RING_SIZE)
+  {
+    errno = ENOBUFS;
+    return ret;
+  }
+
+  frame = &priv->tx_ring[prio][(priv->tx_head[prio] + priv->tx_count[prio]) %
+                               IKBUS_SOCKET_TX_RING_SIZE];
+  frame->nbytes = nbytes;
+  frame->flags = 0;
+  memcpy (frame->data, buf, nbytes);
+  priv->tx_count[prio]++;
+  priv->tx_total++;
+
+  /* Outside a batch only pacing holds the frame, its timer sends it */
+  if ((priv->tx_hold == 0) && (priv->tx_watch == 0))
+    ikbus_socket_tx_rearm (sock);
+
+  return nbytes;
+}
+
+gint
+ikbus_socket_write (IKBusSocket *sock, const guint8 *buf, gint nbytes)
+{
+  return ikbus_socket_write_full (sock, buf, nbytes, IKBUS_SOCKET_PRIO_STATE, 0);
+}
+
+static gint
+ikbus_socket_tx_compare (gconstpointer a, gconstpointer b, G_GNUC_UNUSED gpointer data)
+{
+  const IKBusSocketTxFrame *queued = a;
+  const IKBusSocketTxFrame *frame = b;
+
+  /* Frames with equal deadlines keep their submission order */
+  return (queued->ready_time <= frame->ready_time) ? -1 : 1;
+}
+
+static gboolean
+ikbus_socket_tx_dispatch (GSource *source,
+                          G_GNUC_UNUSED GSourceFunc callback,
+                          gpointer data)
+{
+  IKBusSocket *sock = IKBUS_SOCKET (data);
+  IKBusSocketTxFrame *frame;
+  gint64 now = g_source_get_time (source);
+  GError *error = NULL;
+
+  /*
+   * Queue every frame whose deadline has come, in deadline order, and send
+   * them with the paced ones by priority
+   */
+  ikbus_socket_tx_begin (sock);
+  while ((frame = g_queue_peek_head (&sock->priv->tx_sched)) != NULL)
+  {
+    if (frame->ready_time > now)
+      break;
+    g_queue_pop_head (&sock->priv->tx_sched);
+    ikbus_socket_tx_queue (sock, frame->data, frame->nbytes, frame->prio);
+    g_free (frame);
+  }
+  if (!ikbus_socket_tx_end (sock, &error))
+  {
+    g_warning ("%s\n", error->message);
+    g_clear_error (&error);
+  }
+  ikbus_socket_tx_rearm (sock);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs ikbus_socket_tx_funcs = {
+  NULL, /* prepare */
+  NULL, /* check */
+  ikbus_socket_tx_dispatch,
+  NULL, /* finalize */
+};
+
+/*
+ * Wake the tx source for the next scheduled frame, or for the next paced
+ * one if that comes first and the socket is not waited for anyway.
+ */
+static void
+ikbus_socket_tx_rearm (IKBusSocket *sock)
+{
+  IKBusSocketPrivate *priv = sock->priv;
+  IKBusSocketTxFrame *head = g_queue_peek_head (&priv->tx_sched);
+  gint64 ready_time = (head != NULL) ? head->ready_time : -1;
+
+  if ((priv->tx_total > 0) && (priv->tx_watch == 0) && (priv->tx_gap > 0) &&
+      ((ready_time < 0) || (priv->tx_next < ready_time)))
+    ready_time = priv->tx_next;
+
+  if (priv->tx_source != NULL)
+    g_source_set_ready_time (priv->tx_source, ready_time);
+  else if (ready_time >= 0)
+  {
+    priv->tx_source = g_source_new (&ikbus_socket_tx_funcs, sizeof (GSource));
+    g_source_set_callback (priv->tx_source, NULL, sock, NULL);
+    g_source_set_ready_time (priv->tx_source, ready_time);
+    g_source_attach (priv->tx_source, NULL);
+  }
+}
+
+static void
+ikbus_socket_tx_schedule (IKBusSocket *sock, const guint8 *buf, gint nbytes,
+                          gint64 ready_time, IKBusSocketPriority prio)
+{
+  IKBusSocketTxFrame *frame;
+
+  frame = g_new (IKBusSocketTxFrame, 1);
+  frame->ready_time = ready_time;
+  frame->prio = prio;
+  frame->nbytes = nbytes;
+  memcpy (frame->data, buf, nbytes);
+  g_queue_insert_sorted (&sock->priv->tx_sched, frame, ikbus_socket_tx_compare, NULL);
+  ikbus_socket_tx_rearm (sock);
+}
+
+/**
+ * ikbus_socket_write_full:
+ * Write a frame of priority prio after delay_ms. Frames waiting for the
+ * bus leave highest priority first, a frame of the same priority never
+ * overtakes another. Returns nbytes, or -1 with errno set.
+ */
+gint
+ikbus_socket_write_full (IKBusSocket *sock, const guint8 *buf, gint nbytes,
+                         IKBusSocketPriority prio, guint delay_ms)
+{
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), -1);
+  g_return_val_if_fail (prio < IKBUS_SOCKET_PRIO_LAST, -1);
+
+  if (sock->priv->state != STATE_CONNECTED)
+    return -1;
+
+  if (delay_ms == 0)
+    return ikbus_socket_tx_queue (sock, buf, nbytes, prio);
+
+  if ((nbytes <= 0) || (nbytes > IKBUS_MAX_FRAME_SIZE))
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  ikbus_socket_tx_schedule (sock, buf, nbytes,
+                            g_get_monotonic_time () + (gint64) delay_ms * 1000, prio);
+
+  return nbytes;
+}
+
+/*
+ * Write the frames captured so far, in pcap format. Returns FALSE with
+ * errno set if the file could not be written.
+ */
+static gboolean
+ikbus_socket_capture_flush (IKBusSocketPrivate *priv)
+{
+  IKBusSocketCaptureRecord *rec;
+  guint32 hdr[4];
+  gint64 t;
+
+  while ((rec = ikbus_ring_peek (priv->capture_ring)) != NULL)
+  {
+    t = rec->time + priv->capture_offset;
+    hdr[0] = t / G_USEC_PER_SEC;
+    hdr[1] = t % G_USEC_PER_SEC;
+    hdr[2] = hdr[3] = rec->nbytes + 1;
+    if ((fwrite (hdr, sizeof (hdr), 1, priv->capture_file) != 1) ||
+        (fwrite (&rec->direction, 1, 1, priv->capture_file) != 1) ||
+        (fwrite (rec->data, rec->nbytes, 1, priv->capture_file) != 1))
+      return FALSE;
+    ikbus_ring_release (priv->capture_ring);
+  }
+  return fflush (priv->capture_file) == 0;
+}
+
+static gboolean
+ikbus_socket_capture_timeout (gpointer data)
+{
+  IKBusSocket *sock = IKBUS_SOCKET (data);
+
+  if (ikbus_socket_capture_flush (sock->priv))
+    return G_SOURCE_CONTINUE;
+
+  /* Stopping flushes again and reports the error */
+  sock->priv->capture_id = 0;
+  ikbus_socket_capture_stop (sock);
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Start recording every frame sent and received to filename. Frames are
+ * buffered in memory and written from the main loop a few times a second.
+ */
+gboolean
+ikbus_socket_capture_start (IKBusSocket *sock, const gchar *filename, GError **error)
+{
+  IKBusSocketPrivate *priv;
+  guint32 hdr[6];
+
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), FALSE);
+  g_return_val_if_fail (filename != NULL, FALSE);
+
+  priv = sock->priv;
+  if (priv->capture_file != NULL)
+    return TRUE;
+
+  priv->capture_file = fopen (filename, "wb");
+  if (priv->capture_file == NULL)
+  {
+    int errsv = errno;
+    g_set_error (error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (errsv),
+                 "Fail to open capture file %s: %s", filename, g_strerror (errsv));
+    return FALSE;
+  }
+
+  /* pcap global header: magic, version 2.4, zone, sigfigs, snaplen, linktype */
+  hdr[0] = 0xa1b2c3d4;
+  hdr[1] = 2 | (4 << 16);
+  hdr[2] = 0;
+  hdr[3] = 0;
+  hdr[4] = IKBUS_MAX_FRAME_SIZE + 1;
+  hdr[5] = IKBUS_CAPTURE_LINKTYPE;
+  if (fwrite (hdr, sizeof (hdr), 1, priv->capture_file) != 1)
+  {
+    int errsv = errno;
+    fclose (priv->capture_file);
+    priv->capture_file = NULL;
+    g_set_error (error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (errsv),
+                 "Fail to write capture file %s: %s", filename, g_strerror (errsv));
+    return FALSE;
+  }
+
+  if (priv->capture_ring == NULL)
+    priv->capture_ring = ikbus_ring_new (sizeof (IKBusSocketCaptureRecord), CAPTURE_RING_SIZE);
+
+  /* Frames the I/O thread stored after the last stop */
+  while (ikbus_ring_peek (priv->capture_ring) != NULL)
+    ikbus_ring_release (priv->capture_ring);
+
+  priv->capture_offset = g_get_real_time () - g_get_monotonic_time ();
+  g_atomic_int_set (&priv->capture_dropped, 0);
+  priv->capture_id = g_timeout_add (CAPTURE_FLUSH, ikbus_socket_capture_timeout, sock);
+  g_atomic_int_set (&priv->capture_on, TRUE);
+
+  return TRUE;
+}
+
+void
+ikbus_socket_capture_stop (IKBusSocket *sock)
+{
+  IKBusSocketPrivate *priv;
+  gboolean ok;
+  gint dropped, errsv;
+
+  g_return_if_fail (IKBUS_IS_SOCKET (sock));
+
+  priv = sock->priv;
+  if (priv->capture_file == NULL)
+    return;
+
+  g_atomic_int_set (&priv->capture_on, FALSE);
+  if (priv->capture_id != 0)
+  {
+    g_source_remove (priv->capture_id);
+    priv->capture_id = 0;
+  }
+
+  ok = ikbus_socket_capture_flush (priv);
+  errsv = errno;
+  if (fclose (priv->capture_file) != 0)
+  {
+    ok = FALSE;
+    errsv = errno;
+  }
+  if (!ok)
+    g_warning ("Capture stopped, file incomplete: %s\n", g_strerror (errsv));
+  priv->capture_file = NULL;
+
+  dropped = g_atomic_int_get (&priv->capture_dropped);
+  if (dropped > 0)
+    g_warning ("Capture: %d frames lost\n", dropped);
+}
+
+gboolean
+ikbus_socket_is_capturing (IKBusSocket *sock)
+{
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), FALSE);
+
+  return sock->priv->capture_file != NULL;
+}
+
+/*
+ * Milliseconds since the last frame went out on the bus, counting frames
+ * sent by the I/O thread. Negative once the bus has been quiet for more
+ * than 24 days.
+ */
+gint
+ikbus_socket_get_tx_idle (IKBusSocket *sock)
+{
+  guint now;
+
+  g_return_val_if_fail (IKBUS_IS_SOCKET (sock), -1);
+
+  now = (guint) (g_get_monotonic_time () / 1000);
+  return (gint) (now - (guint) g_atomic_int_get (&sock->priv->tx_last));
+}
+
+/*
+ * Validate a frame read from the bus and describe it. The length byte must
+ * match the frame size, with or without the trailing checksum; a checksum
+ * that is present must be correct.
+ */
+IKBusFrameStatus
+ikbus_frame_parse (IKBusFrame *frame, const guint8 *buf, gint nbytes)
+{
+  guint8 xor = 0;
+  gint len, i;
+
+  if (nbytes <= IKBUS_FRM_CMD)
+    return IKBUS_FRAME_TOO_SHORT;
+
+  len = buf[IKBUS_FRM_SIZE];
+  if (len < 3)
+    return IKBUS_FRAME_BAD_LENGTH;
+
+  if (nbytes == len + 2)
+  {
+    for (i = 0; i < nbytes; i++)
+      xor ^= buf[i];
+    if (xor != 0)
+      return IKBUS_FRAME_BAD_CHECKSUM;
+  }
+  else if (nbytes != len + 1)
+  {
+    return IKBUS_FRAME_BAD_LENGTH;
+  }
+
+  frame->sender = buf[IKBUS_FRM_SENDER];
+  frame->length = len;
+  frame->receiver = buf[IKBUS_FRM_RECEIVER];
+  frame->cmd = buf[IKBUS_FRM_CMD];
+  frame->payload = buf + IKBUS_FRM_CMD + 1;
+  frame->payload_len = len - 3;
+  frame->raw = buf;
+  frame->nbytes = nbytes;
+  frame->flags = 0;
+
+  return IKBUS_FRAME_OK;
+}
+
+static gboolean
+ikbus_socket_initable_init (GInitable *initable,
+                            GCancellable *cancellable,
+                            GError  **error)
+{
+  IKBusSocket *sock;
+  gint sock_fd;
+  guint i;
+
+  g_return_val_if_fail (IKBUS_IS_SOCKET (initable), FALSE);
+  sock = IKBUS_SOCKET (initable);
+
+  if (sock->priv->state >= STATE_SOCKET)
+    return TRUE;
+
+  sock->priv->transport = ikbus_socket_find_transport (sock->priv->ifname);
+  if (sock->priv->transport == NULL)
+  {
+    g_set_error (error,
+                 G_IO_ERROR,
+                 G_IO_ERROR_NOT_SUPPORTED,
+                 "No I/K-bus transport for %s", sock->priv->ifname);
+    return FALSE;
+  }
+
+  sock_fd = sock->priv->transport->open (sock, error);
+  if (sock_fd < 0)
+    return FALSE;
+
+  if (sock->priv->io_thread)
+  {
+    sock->priv->rx_event = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    sock->priv->tx_event = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((sock->priv->rx_event < 0) || (sock->priv->tx_event < 0))
+    {
+      int errsv = errno;
+      close (sock_fd);
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (errsv),
+                   "Fail to create I/O thread events: %s", g_strerror (errsv));
+      return FALSE;
+    }
+    sock->priv->rx_queue = ikbus_ring_new (sizeof (IKBusSocketFrame), IO_QUEUE_SIZE);
+    for (i = 0; i < IKBUS_SOCKET_PRIO_LAST; i++)
+      sock->priv->tx_queue[i] = ikbus_ring_new (sizeof (IKBusSocketFrame), IO_QUEUE_SIZE);
+  }
+
+  sock->priv->fd = sock_fd;
+  sock->priv->state = STATE_SOCKET;
+
+  return TRUE;
+}
+
+static void
+ikbus_socket_initable_iface_init (GInitableIface *iface)
+{
+  iface->init = ikbus_socket_initable_init;
+}
+
+static void
+ikbus_socket_class_init (IKBusSocketClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = ikbus_socket_finalize;
+  object_class->get_property = ikbus_socket_get_property;
+  object_class->set_property = ikbus_socket_set_property;
+
+  obj_properties[PROP_IFNAME] = g_param_spec_string ("ifname",
+                                    "Interface name",
+                                    "The name of the I/K-bus network interface",
+                                    NULL, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  obj_properties[PROP_SOCK_ADDR] = g_param_spec_uchar ("sockaddr",
+                                    "Socket address",
+                                    "Socket address of the I/K-bus network",
+                                    0x00, 0xff, 0xff, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  obj_properties[PROP_CONN_ADDR] = g_param_spec_uchar ("connaddr",
+                                    "Connection address",
+                                    "Interlocutor address of the I/K-bus network",
+                                    0x00, 0xff, 0xff, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  obj_properties[PROP_IO_THREAD] = g_param_spec_boolean ("io-thread",
+                                    "I/O thread",
+                                    "Read the bus and send auto replies on a dedicated thread",
+                                    FALSE, /* default */
+                                    G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+
+  obj_properties[PROP_TX_GAP] = g_param_spec_uint ("tx-gap",
+                                    "TX gap",
+                                    "Silence after each frame on the wire in us, 0 writes frames at once",
+                                    0, G_USEC_PER_SEC,
+                                    0, /* default */
                                     G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
 
   g_object_class_install_properties (object_class, N_PROP, obj_properties);
@@ -276,6 +2071,9 @@ ikbus_socket_init (IKBusSocket *sock)
 {
   sock->priv = ikbus_socket_get_instance_private (sock);
   sock->priv->state = STATE_NONE;
+  sock->priv->rx_event = -1;
+  sock->priv->tx_event = -1;
+  g_queue_init (&sock->priv->tx_sched);
 }
 
 IKBusSocket*
@@ -21,7 +21,7 @@
 #define _IKBUSSOCKET_H_
 
 #include <glib-object.h>
-#include <linux/ikbusframe.h>
+#include "ikbusdefs.h"
 
 G_BEGIN_DECLS
 
@@ -36,12 +36,72 @@ typedef struct _IKBusSocket        IKBusSocket;
 typedef struct _IKBusSocketClass   IKBusSocketClass;
 typedef struct _IKBusSocketPrivate IKBusSocketPrivate;
 typedef guint8  IKBusSocketAddres;
+typedef struct _IKBusSocketFrame   IKBusSocketFrame;
+typedef struct _IKBusFrame         IKBusFrame;
+typedef struct _IKBusSocketSubscription IKBusSocketSubscription;
+
+#define IKBUS_SOCKET_BATCH_SIZE         16
+#define IKBUS_SOCKET_TX_RING_SIZE       16
+#define IKBUS_SOCKET_AUTO_REPLY_MAX     4
+#define IKBUS_SOCKET_ANY_SUB            (-1)
+#define IKBUS_SOCKET_ANY                (-1)   /* Wildcard of a subscription */
+#define IKBUS_SOCKET_SUBSCRIPTIONS_MAX  32
+
+/* Capture files are pcap, each frame preceded by its direction byte */
+#define IKBUS_CAPTURE_LINKTYPE          147     /* LINKTYPE_USER0 */
+#define IKBUS_CAPTURE_RX                0
+#define IKBUS_CAPTURE_TX                1
+
+/* Frame flags */
+#define IKBUS_SOCKET_FRAME_ANSWERED     (1 << 0) /* Auto reply already sent */
+
+struct _IKBusSocketFrame {
+  gint nbytes;
+  guint flags;
+  guint8 data[IKBUS_MAX_FRAME_SIZE];
+};
+
+/* Transmit priority, frames waiting for the bus leave lowest value first */
+typedef enum {
+  IKBUS_SOCKET_PRIO_POLL_REPLY,   /* Answer the sender is waiting for */
+  IKBUS_SOCKET_PRIO_STATE,        /* Unsolicited state change */
+  IKBUS_SOCKET_PRIO_ANNOUNCE,     /* Announces and other housekeeping */
+  IKBUS_SOCKET_PRIO_INPUT,        /* Emulated button presses */
+  IKBUS_SOCKET_PRIO_LAST
+} IKBusSocketPriority;
+
+/* Frames to receive, each field an address or command, or IKBUS_SOCKET_ANY */
+struct _IKBusSocketSubscription {
+  gint sender;
+  gint receiver;
+  gint cmd;
+};
 
 struct _IKBusSocket {
   GObject parent_instance;
   IKBusSocketPrivate *priv;
 };
 
+typedef enum {
+  IKBUS_FRAME_OK,
+  IKBUS_FRAME_TOO_SHORT,          /* Shorter than a frame header */
+  IKBUS_FRAME_BAD_LENGTH,         /* Length byte disagrees with the frame size */
+  IKBUS_FRAME_BAD_CHECKSUM
+} IKBusFrameStatus;
+
+/* Read-only view of a frame held in a caller-owned buffer */
+struct _IKBusFrame {
+  IKBusSocketAddres sender;
+  guint8 length;                  /* Length byte of the frame */
+  IKBusSocketAddres receiver;
+  guint8 cmd;
+  const guint8 *payload;          /* Data after the command byte */
+  gsize payload_len;
+  const guint8 *raw;              /* Whole frame as read from the bus */
+  gint nbytes;
+  guint flags;                    /* IKBUS_SOCKET_FRAME_* */
+};
+
 struct _IKBusSocketClass {
   GObjectClass parent_class;
 };
@@ -54,7 +114,27 @@ gboolean ikbus_socket_connect (IKBusSocket *sock, IKBusSocketAddres addr,
                                IKBusSocketAddres conn, GError **error);
 gint ikbus_socket_get_fd (IKBusSocket *sock);
 gint ikbus_socket_read (IKBusSocket *sock, guint8 *buf);
+gint ikbus_socket_read_batch (IKBusSocket *sock, IKBusSocketFrame *frames, gint nframes);
 gint ikbus_socket_write (IKBusSocket *sock, const guint8 *buf, gint nbytes);
+gint ikbus_socket_write_full (IKBusSocket *sock, const guint8 *buf, gint nbytes,
+                              IKBusSocketPriority prio, guint delay_ms);
+void ikbus_socket_tx_begin (IKBusSocket *sock);
+gboolean ikbus_socket_tx_end (IKBusSocket *sock, GError **error);
+gint ikbus_socket_get_tx_idle (IKBusSocket *sock);
+gboolean ikbus_socket_capture_start (IKBusSocket *sock, const gchar *filename,
+                                     GError **error);
+void ikbus_socket_capture_stop (IKBusSocket *sock);
+gboolean ikbus_socket_is_capturing (IKBusSocket *sock);
+gboolean ikbus_socket_set_auto_reply (IKBusSocket *sock, guint8 cmd, gint sub,
+                                      const guint8 *reply, gint nbytes);
+void ikbus_socket_clear_auto_reply (IKBusSocket *sock, IKBusSocketAddres sender,
+                                    guint8 cmd, gint sub);
+gboolean ikbus_socket_set_subscriptions (IKBusSocket *sock,
+                                         const IKBusSocketSubscription *subs,
+                                         guint nsubs, GError **error);
+gboolean ikbus_socket_get_kernel_filter (IKBusSocket *sock);
+
+IKBusFrameStatus ikbus_frame_parse (IKBusFrame *frame, const guint8 *buf, gint nbytes);
 G_END_DECLS
 
 #endif /* _IKBUSSOCKET_H_ */
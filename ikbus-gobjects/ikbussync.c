@@ -0,0 +1,154 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "ikbusdefs.h"
+#include "ikbussync.h"
+
+#define SYNC_SIZE 256             /* Power of two, holds several longest frames */
+#define SYNC_MASK (SYNC_SIZE - 1)
+
+/*
+ * Bytes are kept in a ring together with the XOR of everything pushed
+ * before them, so the checksum of any candidate frame is two lookups and
+ * resynchronizing is a single pass over the buffer.
+ */
+struct _IKBusSync
+{
+  guint8 buf[SYNC_SIZE];
+  guint8 prefix[SYNC_SIZE];       /* XOR of all bytes before this position */
+  guint8 acc;                     /* XOR of all bytes pushed */
+  guint head;                     /* Free running, wraps with the mask */
+  guint tail;
+  guint64 discarded;              /* Bytes skipped while resynchronizing */
+};
+
+IKBusSync *
+ikbus_sync_new (void)
+{
+  return g_new0 (IKBusSync, 1);
+}
+
+void
+ikbus_sync_free (IKBusSync *sync)
+{
+  g_free (sync);
+}
+
+/* Store as much of data as fits, returns the number of bytes taken */
+gsize
+ikbus_sync_push (IKBusSync *sync, const guint8 *data, gsize len)
+{
+  gsize i;
+
+  len = MIN (len, (gsize) ikbus_sync_get_space (sync));
+  for (i = 0; i < len; i++)
+  {
+    sync->prefix[sync->tail & SYNC_MASK] = sync->acc;
+    sync->buf[sync->tail & SYNC_MASK] = data[i];
+    sync->acc ^= data[i];
+    sync->tail++;
+  }
+
+  return len;
+}
+
+/* XOR of the buffered bytes from start up to end */
+static inline guint8
+ikbus_sync_xor (IKBusSync *sync, guint start, guint end)
+{
+  guint8 last = (end == sync->tail) ? sync->acc : sync->prefix[end & SYNC_MASK];
+
+  return sync->prefix[start & SYNC_MASK] ^ last;
+}
+
+/*
+ * Copy the next complete frame, checksum included, to frame (at least
+ * IKBUS_MAX_FRAME_SIZE bytes). Returns its size, or 0 if more bytes are
+ * needed.
+ */
+gint
+ikbus_sync_pop (IKBusSync *sync, guint8 *frame)
+{
+  guint count, size, i;
+  guint8 len;
+
+  while ((count = sync->tail - sync->head) >= IKBUS_SYNC_MIN_FRAME)
+  {
+    len = sync->buf[(sync->head + IKBUS_FRM_SIZE) & SYNC_MASK];
+    size = len + 2;
+
+    if ((size >= IKBUS_SYNC_MIN_FRAME) && (size <= IKBUS_MAX_FRAME_SIZE))
+    {
+      if (count < size)
+        return 0;
+
+      if (ikbus_sync_xor (sync, sync->head, sync->head + size) == 0)
+      {
+        for (i = 0; i < size; i++)
+          frame[i] = sync->buf[(sync->head + i) & SYNC_MASK];
+        sync->head += size;
+        return size;
+      }
+    }
+
+    /* No frame starts here */
+    sync->head++;
+    sync->discarded++;
+  }
+
+  return 0;
+}
+
+/* Bytes buffered but not returned as a frame yet */
+guint
+ikbus_sync_get_pending (IKBusSync *sync)
+{
+  return sync->tail - sync->head;
+}
+
+/* Bytes to push before ikbus_sync_pop() can decide on the next frame */
+guint
+ikbus_sync_get_needed (IKBusSync *sync)
+{
+  guint count = sync->tail - sync->head;
+  guint size = IKBUS_SYNC_MIN_FRAME;
+
+  if (count > IKBUS_FRM_SIZE)
+  {
+    size = sync->buf[(sync->head + IKBUS_FRM_SIZE) & SYNC_MASK] + 2;
+    if ((size < IKBUS_SYNC_MIN_FRAME) || (size > IKBUS_MAX_FRAME_SIZE))
+      size = IKBUS_SYNC_MIN_FRAME;
+  }
+
+  return (count < size) ? size - count : 0;
+}
+
+guint
+ikbus_sync_get_space (IKBusSync *sync)
+{
+  return SYNC_SIZE - (sync->tail - sync->head);
+}
+
+guint64
+ikbus_sync_get_discarded (IKBusSync *sync)
+{
+  return sync->discarded;
+}
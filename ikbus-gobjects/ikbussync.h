@@ -0,0 +1,50 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IKBUSSYNC_H_
+#define _IKBUSSYNC_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define IKBUS_SYNC_MIN_FRAME    5       /* Sender, length, receiver, command, checksum */
+
+/*
+ * Frame synchronizer for byte stream transports. Bytes go in with
+ * ikbus_sync_push(), whole frames with a valid checksum come out of
+ * ikbus_sync_pop(). Noise is skipped a byte at a time until the length
+ * byte and the checksum agree again.
+ */
+typedef struct _IKBusSync IKBusSync;
+
+IKBusSync *ikbus_sync_new (void);
+void ikbus_sync_free (IKBusSync *sync);
+
+gsize ikbus_sync_push (IKBusSync *sync, const guint8 *data, gsize len);
+gint ikbus_sync_pop (IKBusSync *sync, guint8 *frame);
+
+guint ikbus_sync_get_pending (IKBusSync *sync);
+guint ikbus_sync_get_needed (IKBusSync *sync);
+guint ikbus_sync_get_space (IKBusSync *sync);
+guint64 ikbus_sync_get_discarded (IKBusSync *sync);
+
+G_END_DECLS
+
+#endif /* _IKBUSSYNC_H_ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2016 Vladimir Korol <vovabox@mail.ru>
+ *
+ * This file is part of ikbus-apps.
+ *
+ * ikbus-apps is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ikbus-apps is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ikbus-apps. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Subscription filter check. Frames are sent into one end of a socketpair
+ * whose other end is an IKBusSocket with subscriptions, and the frames the
+ * socket reads are compared with the ones the subscriptions accept. The
+ * socket filter has to be taken by the kernel, so this checks the compiled
+ * program rather than the userspace fallback.
+ */
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ikbusdefs.h"
+#include "ikbussocket.h"
+
+static const IKBusSocketSubscription subs[] = {
+    { IKBUS_DEV_RAD, IKBUS_DEV_CDC, IKBUS_SOCKET_ANY },
+    { IKBUS_SOCKET_ANY, IKBUS_DEV_LOC, IKBUS_MSG_DEV_STAT_READY },
+    { IKBUS_DEV_DIA, IKBUS_SOCKET_ANY, IKBUS_SOCKET_ANY },
+    { IKBUS_SOCKET_ANY, IKBUS_SOCKET_ANY, IKBUS_MSG_CD_CTL },
+};
+
+static const struct {
+    guint8 data[5];
+    gint nbytes;
+    gboolean accept;
+} frames[] = {
+    { { IKBUS_DEV_RAD, 0x03, IKBUS_DEV_CDC, IKBUS_MSG_DEV_STAT_REQ, 0x72 }, 5, TRUE },
+    { { IKBUS_DEV_RAD, 0x03, IKBUS_DEV_MID, IKBUS_MSG_DEV_STAT_REQ, 0xaa }, 5, FALSE },
+    { { IKBUS_DEV_MID, 0x03, IKBUS_DEV_LOC, IKBUS_MSG_DEV_STAT_READY, 0x3e }, 5, TRUE },
+    { { IKBUS_DEV_MID, 0x03, IKBUS_DEV_LOC, IKBUS_MSG_BUTTON, 0x0d }, 5, FALSE },
+    { { IKBUS_DEV_DIA, 0x03, IKBUS_DEV_CDC, IKBUS_DIA_READ_IDENT, 0x24 }, 5, TRUE },
+    { { IKBUS_DEV_MID, 0x03, IKBUS_DEV_RAD, IKBUS_MSG_CD_CTL, 0x93 }, 5, TRUE },
+    { { IKBUS_DEV_MID, 0x03, IKBUS_DEV_RAD, IKBUS_MSG_CD_STAT, 0x92 }, 5, FALSE },
+    { { IKBUS_DEV_RAD, 0x03 }, 2, FALSE },     /* Too short for the receiver byte */
+};
+
+int main(void)
+{
+    IKBusSocketFrame rx[IKBUS_SOCKET_BATCH_SIZE];
+    IKBusSocket *sock;
+    GError *error = NULL;
+    gchar *ifname;
+    gint fds[2], n, failed = 0;
+    guint i;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        g_printerr("socketpair: %s\n", g_strerror(errno));
+        return 1;
+    }
+
+    ifname = g_strdup_printf("fd:%d", fds[1]);
+    sock = ikbus_socket_new(ifname, &error);
+    g_free(ifname);
+    close(fds[1]);
+    if ((sock == NULL) ||
+        !ikbus_socket_connect(sock, IKBUS_DEV_LOC, IKBUS_DEV_LOC, &error) ||
+        !ikbus_socket_set_subscriptions(sock, subs, G_N_ELEMENTS(subs), &error)) {
+        g_printerr("IKBus: %s\n", error->message);
+        return 1;
+    }
+    if (!ikbus_socket_get_kernel_filter(sock)) {
+        g_printerr("The kernel did not take the socket filter\n");
+        return 1;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(frames); i++) {
+        if (write(fds[0], frames[i].data, frames[i].nbytes) < 0) {
+            g_printerr("write: %s\n", g_strerror(errno));
+            return 1;
+        }
+        n = ikbus_socket_read_batch(sock, rx, G_N_ELEMENTS(rx));
+        if ((n < 0) || ((n > 0) != frames[i].accept) ||
+            ((n > 0) && ((n != 1) || (rx[0].nbytes != frames[i].nbytes) ||
+                         memcmp(rx[0].data, frames[i].data, frames[i].nbytes)))) {
+            g_print("Frame %u: %s, read %d\n", i,
+                    frames[i].accept ? "accepted" : "dropped", n);
+            failed++;
+        }
+    }
+
+    g_print("%u frames, %d wrong\n", (guint) G_N_ELEMENTS(frames), failed);
+    g_object_unref(sock);
+    close(fds[0]);
+
+    return (failed == 0) ? 0 : 1;
+}